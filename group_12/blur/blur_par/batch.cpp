@@ -0,0 +1,146 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "batch.hpp"
+#include "matrix.hpp"
+#include "ppm.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <pthread.h>
+#include <stdexcept>
+#include <utility>
+
+namespace Batch {
+
+namespace {
+
+    // An image and its file, for the threads that read and write while blur runs
+    struct Transfer {
+        std::string const* filename;
+        Matrix image;
+        // whether store wrote the image
+        bool stored;
+    };
+
+    void* load(void* arg)
+    {
+        auto transfer { static_cast<Transfer*>(arg) };
+        PPM::Reader reader { PPM::Reader::Mode::mmap };
+        transfer->image = reader(*transfer->filename);
+        return nullptr;
+    }
+
+    void* store(void* arg)
+    {
+        auto transfer { static_cast<Transfer*>(arg) };
+        PPM::Writer writer {};
+        transfer->stored = writer(transfer->image, *transfer->filename);
+        return nullptr;
+    }
+
+}
+
+std::vector<Job> find_jobs(std::string source, std::string out_dir)
+{
+    namespace fs = std::filesystem;
+    std::vector<std::string> inputs;
+    std::error_code ec;
+
+    if (fs::is_directory(source, ec)) {
+        for (auto const& entry : fs::directory_iterator { source, ec }) {
+            if (entry.is_regular_file(ec) && entry.path().extension() == ".ppm") {
+                inputs.push_back(entry.path().string());
+            }
+        }
+        if (ec) {
+            throw std::runtime_error { "couldn't list directory " + source };
+        }
+        std::sort(inputs.begin(), inputs.end());
+    } else {
+        std::ifstream list { source };
+
+        if (!list) {
+            throw std::runtime_error { "couldn't open list " + source };
+        }
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                inputs.push_back(line);
+            }
+        }
+    }
+
+    fs::create_directories(out_dir, ec);
+
+    if (ec) {
+        throw std::runtime_error { "couldn't create directory " + out_dir };
+    }
+
+    std::vector<Job> jobs;
+
+    for (auto const& input : inputs) {
+        jobs.push_back({ input, (fs::path { out_dir } / fs::path { input }.filename()).string() });
+    }
+
+    return jobs;
+}
+
+unsigned run(std::vector<Job> const& jobs, int radius, Pool& pool, Filter::Mode mode, Filter::Schedule schedule)
+{
+    if (jobs.empty()) {
+        return 0;
+    }
+
+    Matrix scratch {};
+    Transfer next { &jobs[0].input, {}, false };
+    Transfer previous { nullptr, {}, false };
+    pthread_t loader, storer;
+    unsigned blurred { 0 };
+
+    // nothing to overlap the first read with
+    load(&next);
+
+    for (size_t i { 0 }; i < jobs.size(); i++) {
+        auto current { std::move(next.image) };
+        auto loading { i + 1 < jobs.size() };
+        auto storing { previous.filename != nullptr };
+
+        if (loading) {
+            next.filename = &jobs[i + 1].input;
+            pthread_create(&loader, nullptr, load, &next);
+        }
+        if (storing) {
+            pthread_create(&storer, nullptr, store, &previous);
+        }
+
+        // the reader has already reported images that failed to load
+        auto loaded { current.get_x_size() > 0 };
+        Matrix result {};
+
+        if (loaded) {
+            result = Filter::blur(current, radius, pool, scratch, mode, schedule);
+        }
+
+        if (loading) {
+            pthread_join(loader, nullptr);
+        }
+        // the writer has already reported images that failed to store
+        if (storing) {
+            pthread_join(storer, nullptr);
+            blurred += previous.stored;
+        }
+
+        previous.filename = loaded ? &jobs[i].output : nullptr;
+        previous.image = std::move(result);
+    }
+
+    if (previous.filename) {
+        store(&previous);
+        blurred += previous.stored;
+    }
+
+    return blurred;
+}
+
+}
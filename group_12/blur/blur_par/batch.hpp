@@ -0,0 +1,35 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "filters.hpp"
+#include "pool.hpp"
+#include <string>
+#include <vector>
+
+#if !defined(BATCH_HPP)
+#define BATCH_HPP
+
+namespace Batch {
+
+// One image to blur and where the result goes
+struct Job {
+    std::string input;
+    std::string output;
+};
+
+// Jobs for every .ppm file in source when it is a directory, or for every line of
+// source when it is a file, writing each to a file of the same name in out_dir.
+// Directory entries are sorted by name. Creates out_dir if needed, throws
+// std::runtime_error when source can't be read.
+std::vector<Job> find_jobs(std::string source, std::string out_dir);
+
+// Blurs every job on pool, reading the next image and writing the previous one while
+// the current one is blurred. The pool and one scratch image are shared by the whole
+// batch. Images that fail to load or store are reported and skipped. Returns how many
+// were blurred and written.
+unsigned run(std::vector<Job> const& jobs, int radius, Pool& pool, Filter::Mode mode, Filter::Schedule schedule);
+
+}
+
+#endif
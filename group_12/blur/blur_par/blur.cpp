@@ -2,28 +2,311 @@
 Author: David Holmqvist <daae19@student.bth.se>
 */
 
+#include "batch.hpp"
 #include "matrix.hpp"
 #include "ppm.hpp"
 #include "filters.hpp"
+#include "pool.hpp"
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Reads X,Y,W,H into rect, false when text is anything else
+bool parse_rect(std::string const& text, Filter::Rect& rect)
+{
+    std::istringstream in { text };
+    char comma1 {}, comma2 {}, comma3 {};
+    in >> rect.x >> comma1 >> rect.y >> comma2 >> rect.x_size >> comma3 >> rect.y_size;
+
+    return in && in.eof() && comma1 == ',' && comma2 == ',' && comma3 == ',';
+}
+
+}
 
 int main(int argc, char const* argv[])
 {
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " [radius] [infile] [outfile] [threads]" << std::endl;
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " [radius|chain|radii] [infile] [outfile] [threads] [options...]" << std::endl;
+        std::cerr << "Options may come in any order:" << std::endl;
+        std::cerr << "Modes: gauss (default), iir, box, fixed, float32" << std::endl;
+        std::cerr << "Schedules: passes (default), pipelined, stealing" << std::endl;
+        std::cerr << "stream reads and writes a row at a time for images too big for memory, gauss only" << std::endl;
+        std::cerr << "batch takes a directory or a list file of images as infile and a directory as outfile" << std::endl;
+        std::cerr << "chain runs filters in one fused pass instead of blurring, such as blur:15,blur:3" << std::endl;
+        std::cerr << "Chain steps: blur:R, box:R, sobel:x, sobel:y" << std::endl;
+        std::cerr << "radii such as 2,4,8 blur at each in one traversal into outfile with _0, _1, ... before the extension" << std::endl;
+        std::cerr << "cascaded blurs each of those radii the one before instead of the input" << std::endl;
+        std::cerr << "packed blurs in the RGBX layout instead of planes" << std::endl;
+        std::cerr << "roi:X,Y,W,H blurs only that region of the image, reading the pixels around it" << std::endl;
+        std::cerr << "from:FILE changed:X,Y,W,H updates FILE, the earlier output for infile, after that region of infile" << std::endl;
+        std::cerr << "changed may be given more than once" << std::endl;
+        std::cerr << "huge backs images with transparent huge pages, hugetlb with reserved ones" << std::endl;
+        std::cerr << "stats prints the time each thread spent working" << std::endl;
+        std::exit(1);
+    }
+
+    auto mode { Filter::Mode::gauss };
+    auto schedule { Filter::Schedule::passes };
+    auto stats { false };
+    auto stream { false };
+    auto batch { false };
+    auto layout { Matrix::Layout::planar };
+    auto roi { false };
+    auto stack { Filter::Stack::separate };
+    // whether a schedule or a mode was given, each may only be given once
+    auto scheduled { false };
+    auto moded { false };
+    Filter::Rect region {};
+    std::string previous {};
+    std::vector<Filter::Rect> changed;
+
+    // the options are optional and may come in any order
+    for (auto i { 5 }; i < argc; i++) {
+        std::string name { argv[i] };
+
+        if (name == "stats") {
+            stats = true;
+        } else if (name == "stream") {
+            stream = true;
+        } else if (name == "batch") {
+            batch = true;
+        } else if (name == "packed") {
+            layout = Matrix::Layout::packed;
+        } else if (name.rfind("roi:", 0) == 0) {
+            if (!parse_rect(name.substr(4), region)) {
+                std::cerr << "Bad region: " << name << std::endl;
+                std::exit(1);
+            }
+            roi = true;
+        } else if (name.rfind("changed:", 0) == 0) {
+            changed.emplace_back();
+            if (!parse_rect(name.substr(8), changed.back())) {
+                std::cerr << "Bad region: " << name << std::endl;
+                std::exit(1);
+            }
+        } else if (name.rfind("from:", 0) == 0) {
+            previous = name.substr(5);
+        } else if (name == "cascaded") {
+            stack = Filter::Stack::cascaded;
+        } else if (name == "huge") {
+            Matrix::set_pages(Matrix::Pages::transparent);
+        } else if (name == "hugetlb") {
+            Matrix::set_pages(Matrix::Pages::hugetlb);
+        } else if (name == "pipelined" || name == "stealing" || name == "passes") {
+            if (scheduled) {
+                std::cerr << "More than one schedule: " << name << std::endl;
+                std::exit(1);
+            }
+            schedule = name == "pipelined" ? Filter::Schedule::pipelined
+                : name == "stealing"       ? Filter::Schedule::stealing
+                                           : Filter::Schedule::passes;
+            scheduled = true;
+        } else if (name == "gauss" || name == "iir" || name == "box" || name == "fixed" || name == "float32") {
+            if (moded) {
+                std::cerr << "More than one mode: " << name << std::endl;
+                std::exit(1);
+            }
+            mode = name == "iir" ? Filter::Mode::iir
+                : name == "box"   ? Filter::Mode::box
+                : name == "fixed" ? Filter::Mode::fixed
+                : name == "float32" ? Filter::Mode::float32
+                                    : Filter::Mode::gauss;
+            moded = true;
+        } else {
+            std::cerr << "Unknown option: " << name << std::endl;
+            std::exit(1);
+        }
+    }
+
+    // a radius is a plain number, anything with a step in it is a chain
+    std::string spec { argv[1] };
+    auto chained { spec.find(':') != std::string::npos };
+    std::vector<Filter::Stage> stages;
+
+    if (chained) {
+        if (mode != Filter::Mode::gauss || batch) {
+            std::cerr << "chains only support the gauss mode and no batch" << std::endl;
+            std::exit(1);
+        }
+
+        try {
+            stages = Filter::parse_chain(spec);
+        } catch (std::runtime_error const& e) {
+            std::cerr << "Bad chain: " << e.what() << std::endl;
+            std::exit(1);
+        }
+    }
+
+    // a list of radii is a stack
+    auto stacked { !chained && spec.find(',') != std::string::npos };
+    std::vector<int> radii;
+
+    if (stacked) {
+        if (mode != Filter::Mode::gauss || stream || batch || roi) {
+            std::cerr << "stacks only support the gauss mode and no stream, batch or region" << std::endl;
+            std::exit(1);
+        }
+
+        std::istringstream in { spec };
+        for (std::string radius; std::getline(in, radius, ',');) {
+            try {
+                radii.push_back(std::stoi(radius));
+            } catch (std::exception const&) {
+                radii.push_back(-1);
+            }
+            if (radii.back() < static_cast<int>(Filter::Gauss::min_radius) || radii.back() >= static_cast<int>(Filter::Gauss::max_radius)) {
+                std::cerr << "Bad radius in stack: " << radius << std::endl;
+                std::exit(1);
+            }
+        }
+    }
+
+    if (roi && (mode != Filter::Mode::gauss || stream || batch)) {
+        std::cerr << "regions only support the gauss mode and no stream or batch" << std::endl;
+        std::exit(1);
+    }
+
+    auto update { !previous.empty() };
+
+    if (update != !changed.empty()) {
+        std::cerr << "from and changed go together" << std::endl;
+        std::exit(1);
+    }
+
+    if (update && (mode != Filter::Mode::gauss || stream || batch || roi || stacked)) {
+        std::cerr << "updates only support the gauss mode and no stream, batch, region or stack" << std::endl;
+        std::exit(1);
+    }
+
+    if (stack == Filter::Stack::cascaded && !stacked) {
+        std::cerr << "cascaded only applies to a list of radii" << std::endl;
+        std::exit(1);
+    }
+
+    if (layout == Matrix::Layout::packed && (stream || batch)) {
+        std::cerr << "packed does not support stream or batch" << std::endl;
+        std::exit(1);
+    }
+
+    if (stream && (scheduled || stats)) {
+        std::cerr << "stream runs on its own without a schedule or stats" << std::endl;
         std::exit(1);
     }
 
-    PPM::Reader reader {};
+    // chains, stacks, regions and updates run the fused row engine, which has no schedule
+    if (scheduled && (chained || stacked || roi || update)) {
+        std::cerr << "schedules only apply to a radius blurred whole or in a batch" << std::endl;
+        std::exit(1);
+    }
+
+    if (stream) {
+        if (mode != Filter::Mode::gauss) {
+            std::cerr << "stream only supports the gauss mode" << std::endl;
+            std::exit(1);
+        }
+
+        try {
+            PPM::Row_Reader reader { argv[2] };
+            PPM::Row_Writer writer { argv[3], reader.get_header() };
+            if (chained) {
+                Filter::convolve_stream(reader, writer, stages);
+            } else {
+                Filter::blur_stream(reader, writer, std::stoul(argv[1]));
+            }
+        } catch (std::runtime_error const& e) {
+            PPM::error("streaming", e.what());
+            std::exit(1);
+        }
+        return 0;
+    }
+
+    auto radius { chained || stacked ? 0u : static_cast<unsigned>(std::stoul(argv[1])) };
+    auto threads { static_cast<unsigned>(std::stoul(argv[4])) };
+
+    Pool pool { threads };
+
+    if (batch) {
+        std::vector<Batch::Job> jobs;
+
+        try {
+            jobs = Batch::find_jobs(argv[2], argv[3]);
+        } catch (std::runtime_error const& e) {
+            std::cerr << "Batch error: " << e.what() << std::endl;
+            std::exit(1);
+        }
+
+        auto begin { std::chrono::steady_clock::now() };
+        auto blurred { Batch::run(jobs, radius, pool, mode, schedule) };
+        std::chrono::duration<double> elapsed { std::chrono::steady_clock::now() - begin };
+
+        std::cout << "Blurred " << blurred << " of " << jobs.size() << " images in " << elapsed.count()
+                  << " s, " << blurred / elapsed.count() << " images/s" << std::endl;
+
+        return blurred == jobs.size() ? 0 : 1;
+    }
+
+    PPM::Reader reader { PPM::Reader::Mode::mmap };
     PPM::Writer writer {};
 
     auto m { reader(argv[2]) };
-    auto radius { static_cast<unsigned>(std::stoul(argv[1])) };
-    auto threads { static_cast<unsigned>(std::stoul(argv[4])) };
+    Matrix scratch {};
+
+    // the reader makes planes, the repacking is not part of the busy times
+    if (layout == Matrix::Layout::packed) {
+        m = Matrix { m, layout };
+    }
+
+    if (stacked) {
+        std::string out { argv[3] };
+        auto dot { out.find_last_of('.') };
+        if (dot == std::string::npos || out.find('/', dot) != std::string::npos) {
+            dot = out.size();
+        }
 
-    auto blurred { Filter::blur(m, radius, threads) };
-    writer(blurred, argv[3]);
+        auto blurred { Filter::blur_stack(m, radii, pool, stack) };
+        for (auto k { 0u }; k < blurred.size(); k++) {
+            writer(blurred[k], out.substr(0, dot) + "_" + std::to_string(k) + out.substr(dot));
+        }
+    } else if (roi) {
+        // the rest of the image is written out as it came in
+        try {
+            MatrixView view { m, region.x, region.y, region.x_size, region.y_size };
+            auto blurred { chained ? Filter::convolve(view, stages, pool) : Filter::blur(view, radius, pool) };
+            m.paste(blurred, region.x, region.y);
+        } catch (std::out_of_range const& e) {
+            std::cerr << "Bad region: " << e.what() << std::endl;
+            std::exit(1);
+        }
+        writer(m, argv[3]);
+    } else if (update) {
+        auto blurred { reader(previous) };
+        try {
+            if (chained) {
+                Filter::convolve_update(m, blurred, changed, stages, pool);
+            } else {
+                Filter::blur_update(m, blurred, changed, radius, pool);
+            }
+        } catch (std::runtime_error const& e) {
+            std::cerr << "Bad update: " << e.what() << std::endl;
+            std::exit(1);
+        }
+        writer(blurred, argv[3]);
+    } else {
+        auto blurred { chained ? Filter::convolve(m, stages, pool) : Filter::blur(m, radius, pool, scratch, mode, schedule) };
+        writer(blurred, argv[3]);
+    }
+
+    if (stats) {
+        for (auto t { 0u }; t < pool.size(); t++) {
+            std::cerr << "thread " << t << ": busy " << pool.busy(t) << " s" << std::endl;
+        }
+    }
 
     return 0;
 }
@@ -3,24 +3,72 @@ Author: David Holmqvist <daae19@student.bth.se>
 */
 
 #include "filters.hpp"
+#include "fixed.hpp"
+#include "float32.hpp"
+#include "packed.hpp"
 #include "matrix.hpp"
 #include "ppm.hpp"
+#include <algorithm>
 #include <cmath>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 namespace Filter
 {
+    // Filters count samples in place, each holding lanes independent values side by side.
+    // data has line_padding samples of room on both sides of the samples and work is a
+    // second buffer of the same size. params holds the filter's own parameters.
+    using Line_Filter = void (*)(double* data, double* work, unsigned count, unsigned lanes, const double* params);
+
+    // Padding samples on each side of a line handed to a Line_Filter
+    constexpr unsigned line_padding{3};
+
     // data for each thread
     struct Thread_Data {
         unsigned start_y, end_y;
         Matrix* dst;
         Matrix* scratch;
-        unsigned char* R;
-        unsigned char* G;
-        unsigned char* B;
+        const unsigned char* R;
+        const unsigned char* G;
+        const unsigned char* B;
+        // RGBX input of a packed matrix
+        const unsigned char* pixels;
         const double* weights;
         int radius;
         unsigned x_size;
+        // Matrix::get_stride of the input, scratch and dst alike
+        unsigned stride;
         unsigned y_size;
+        // where dst starts in the input for passes that make a region of it
+        unsigned origin_x, origin_y;
+        // columns for passes that split the image vertically
+        unsigned start_x, end_x;
+        // filter run by the line based passes, weights holds its parameters
+        Line_Filter line_filter;
+        // Q15 weights along a row and along a column for the fixed point passes
+        const Fixed::Table* row_table;
+        const Fixed::Table* column_table;
+        // single precision weights along a row and along a column for the float32 passes
+        const Float32::Table* row_floats;
+        const Float32::Table* column_floats;
+        // kernels of the direct passes and their normalizer at every position of a row
+        // and of a column
+        const Kernel* row_kernel;
+        const Kernel* column_kernel;
+        // stages of a fused chain or of a stack
+        const std::vector<Stage>* stages;
+        // outputs of a stack, one for each stage
+        std::vector<Matrix>* outputs;
+        const double* row_norms;
+        const double* column_norms;
+        // for the stealing schedule, the pass to run on each task, whether its tasks are
+        // bands of columns instead of rows, the queues and the thread's own queue
+        void* (*task_worker)(void*);
+        bool task_columns;
+        Task_Queues* queues;
+        unsigned thread;
     };
 
 
@@ -34,54 +82,360 @@ namespace Filter
                 weights_out[i] = exp(-x * x * pi);
             }
         }
+
+        Kernel get_kernel(int n)
+        {
+            double weights[max_radius + 1]{};
+            get_weights(n, weights);
+
+            Kernel kernel{n, std::vector<double>(2 * n + 1), Edge::renormalize, 0};
+            for (auto i{0}; i <= n; i++)
+            {
+                kernel.weights[n - i] = kernel.weights[n + i] = weights[i];
+            }
+            return kernel;
+        }
+
+        double sigma(int n)
+        {
+            // exp(-x * x * pi) with x = i * max_x / n is exp(-i * i / (2 * sigma * sigma))
+            return n / (max_x * std::sqrt(2 * M_PI));
+        }
+
+        void get_recursive_coefficients(double sigma, double *coefficients_out)
+        {
+            // Young and van Vliet, "Recursive implementation of the Gaussian filter", 1995
+            double q{sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                                  : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma)};
+            double q2{q * q}, q3{q2 * q};
+            double b0{1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3};
+            double b1{2.44413 * q + 2.85619 * q2 + 1.26661 * q3};
+            double b2{-(1.4281 * q2 + 1.26661 * q3)};
+            double b3{0.422205 * q3};
+
+            coefficients_out[0] = 1 - (b1 + b2 + b3) / b0;
+            coefficients_out[1] = b1 / b0;
+            coefficients_out[2] = b2 / b0;
+            coefficients_out[3] = b3 / b0;
+        }
+
+        void get_box_radii(double sigma, int *radii_out)
+        {
+            // Widths of box_passes boxes whose combined variance is closest to sigma^2, the
+            // first m are the odd width w and the rest w + 2 (Kovesi, "Fast almost-Gaussian
+            // filtering", 2010)
+            double ideal{std::sqrt(12 * sigma * sigma / box_passes + 1)};
+            int w{static_cast<int>(std::floor(ideal))};
+            if (w % 2 == 0) w--;
+            double m_ideal{(12 * sigma * sigma - box_passes * w * w - 4.0 * box_passes * w - 3.0 * box_passes) / (-4.0 * w - 4)};
+            int m{static_cast<int>(std::round(m_ideal))};
+
+            for (auto i{0}; i < box_passes; i++)
+            {
+                radii_out[i] = ((i < m ? w : w + 2) - 1) / 2;
+            }
+        }
+    }
+
+    // Columns handled at once by the line based vertical pass
+    constexpr unsigned line_strip{64};
+
+    // Rows in one task of the stealing schedule, small enough that 32 threads get
+    // several tasks each on a 1000 row image. Passes over columns use line_strip.
+    constexpr unsigned steal_rows{8};
+
+    // Columns handled at once by the direct vertical pass, the rows of one strip under a
+    // radius 100 kernel take 200 KB and fit in L2
+    constexpr unsigned column_strip{1024};
+
+    // Runs the causal and then the anti-causal recursion along the line. The padding
+    // is filled with the replicated edge so the loops need no boundary checks.
+    void recursive_lines(double* data, double*, unsigned count, unsigned lanes, const double* c)
+    {
+        auto B = c[0], b1 = c[1], b2 = c[2], b3 = c[3];
+        auto first = data + 3 * lanes, last = data + (count + 2) * lanes;
+
+        for (auto p = 0u; p < 3; p++)
+            for (auto l = 0u; l < lanes; l++) data[p * lanes + l] = first[l];
+
+        for (auto i = 3u; i < count + 3; i++) {
+            auto cur = data + i * lanes, p1 = cur - lanes, p2 = p1 - lanes, p3 = p2 - lanes;
+            for (auto l = 0u; l < lanes; l++)
+                cur[l] = B * cur[l] + b1 * p1[l] + b2 * p2[l] + b3 * p3[l];
+        }
+
+        for (auto p = 1u; p <= 3; p++)
+            for (auto l = 0u; l < lanes; l++) last[p * lanes + l] = last[l];
+
+        for (auto i = count + 2; i >= 3; i--) {
+            auto cur = data + i * lanes, n1 = cur + lanes, n2 = n1 + lanes, n3 = n2 + lanes;
+            for (auto l = 0u; l < lanes; l++)
+                cur[l] = B * cur[l] + b1 * n1[l] + b2 * n2[l] + b3 * n3[l];
+        }
+    }
+
+    // One box pass from in to out with a running sum, O(1) per sample whatever the
+    // radius. Like the direct kernel, the sum near the edges is divided by the number
+    // of samples that fall inside the line.
+    void box_line(const double* in, double* out, unsigned count, unsigned lanes, int radius, double* sums)
+    {
+        int n = count;
+        int inside = std::min(radius, n - 1) + 1;
+
+        for (auto l = 0u; l < lanes; l++) sums[l] = 0;
+        for (auto i = 0; i < inside; i++)
+            for (auto l = 0u; l < lanes; l++) sums[l] += in[i * lanes + l];
+
+        for (auto i = 0; i < n; i++) {
+            auto cur = out + i * lanes;
+            double scale = 1.0 / inside;
+            for (auto l = 0u; l < lanes; l++) cur[l] = sums[l] * scale;
+
+            // slide the window from [i - radius, i + radius] to one sample further
+            if (i + radius + 1 < n) {
+                auto add = in + (i + radius + 1) * lanes;
+                for (auto l = 0u; l < lanes; l++) sums[l] += add[l];
+                inside++;
+            }
+            if (i - radius >= 0) {
+                auto remove = in + (i - radius) * lanes;
+                for (auto l = 0u; l < lanes; l++) sums[l] -= remove[l];
+                inside--;
+            }
+        }
+    }
+
+    // Gauss::box_passes box passes with the radii in params, ping-ponging between data and work
+    void box_lines(double* data, double* work, unsigned count, unsigned lanes, const double* params)
+    {
+        auto samples = data + line_padding * lanes, other = work + line_padding * lanes;
+        // the padding in front of the samples is free to hold the running sums
+        auto sums = work;
+
+        for (auto pass = 0; pass < Gauss::box_passes; pass++) {
+            box_line(samples, other, count, lanes, static_cast<int>(params[pass]), sums);
+            std::swap(samples, other);
+        }
+
+        if (samples != data + line_padding * lanes) {
+            std::copy(samples, samples + count * lanes, data + line_padding * lanes);
+        }
+    }
+
+    // Truncates a filtered value back into a pixel like the direct kernel does. The
+    // recursion can overshoot slightly, and flat areas can land a hair below the integer
+    // they should be, hence the clamp and the small bias.
+    unsigned char to_pixel(double v)
+    {
+        return static_cast<unsigned char>(std::min(std::max(v + 1e-6, 0.0), 255.0));
+    }
+
+    // Truncates the result of a direct pass back into a pixel. Blurs stay within
+    // 0 .. 255 by themselves, the clamp is for kernels with negative weights or an offset.
+    unsigned char clamp_pixel(double v)
+    {
+        return static_cast<unsigned char>(std::min(std::max(v, 0.0), 255.0));
+    }
+
+    // sums[i] is the weighted sum of the samples around tap(0)[i], taking before of them
+    // on the lower side and after on the upper side, tap(k) being the samples k steps
+    // away and w[k] their weight. Taps are added nearest first and lower side first, the
+    // order the per pixel kernel always used, so the sums are bit exact. Inside the loops
+    // over i there are no bounds checks and every sum is independent, which lets the
+    // compiler vectorize them.
+    template <typename Taps>
+    void weighted_sums(Taps tap, const double* w, int before, int after, double* sums, unsigned count);
+
+    // weighted_sums with R taps on both sides known at compile time. The taps are
+    // unrolled, so each sum stays in a register through all of them instead of going
+    // through sums once per tap. They are added in the same order, so the sums are the
+    // same to the bit.
+    template <int R, typename Taps>
+    __attribute__((always_inline)) inline void unrolled_sums(Taps tap, const double* w, double* __restrict sums, unsigned count)
+    {
+        const unsigned char* lower[R + 1];
+        const unsigned char* upper[R + 1];
+        for (auto k = 0; k <= R; k++) {
+            lower[k] = tap(-k);
+            upper[k] = tap(k);
+        }
+
+        for (auto i = 0u; i < count; i++) {
+            double sum = w[0] * upper[0][i];
+#pragma GCC unroll 64
+            for (auto k = 1; k <= R; k++) {
+                sum += w[-k] * lower[k][i];
+                sum += w[k] * upper[k][i];
+            }
+            sums[i] = sum;
+        }
+    }
+
+    template <int R, typename Taps>
+    void unrolled_sums_generic(Taps tap, const double* w, double* sums, unsigned count)
+    {
+        unrolled_sums<R>(tap, w, sums, count);
+    }
+
+    // Four sums to a vector instead of two. AVX2 without FMA rounds every product and
+    // sum like the generic code does, so the result is the same.
+    template <int R, typename Taps>
+    __attribute__((target("avx2"))) void unrolled_sums_avx2(Taps tap, const double* w, double* sums, unsigned count)
+    {
+        unrolled_sums<R>(tap, w, sums, count);
+    }
+
+    template <int R, typename Taps>
+    void dispatch_unrolled_sums(Taps tap, const double* w, double* sums, unsigned count)
+    {
+        static const auto kernel{__builtin_cpu_supports("avx2") ? unrolled_sums_avx2<R, Taps> : unrolled_sums_generic<R, Taps>};
+        kernel(tap, w, sums, count);
+    }
+
+    // Radii with an unrolled_sums, the ones used most
+    constexpr int unrolled_radii[]{3, 5, 7, 15, 31};
+
+    // unrolled_sums for radius when it has one, false for weighted_sums to do it
+    template <typename Taps>
+    bool try_unrolled_sums(Taps tap, const double* w, int radius, double* sums, unsigned count)
+    {
+        switch (radius) {
+        case unrolled_radii[0]: dispatch_unrolled_sums<unrolled_radii[0]>(tap, w, sums, count); return true;
+        case unrolled_radii[1]: dispatch_unrolled_sums<unrolled_radii[1]>(tap, w, sums, count); return true;
+        case unrolled_radii[2]: dispatch_unrolled_sums<unrolled_radii[2]>(tap, w, sums, count); return true;
+        case unrolled_radii[3]: dispatch_unrolled_sums<unrolled_radii[3]>(tap, w, sums, count); return true;
+        case unrolled_radii[4]: dispatch_unrolled_sums<unrolled_radii[4]>(tap, w, sums, count); return true;
+        default: return false;
+        }
+    }
+
+    template <typename Taps>
+    void weighted_sums(Taps tap, const double* w, int before, int after, double* sums, unsigned count)
+    {
+        // whole rows and columns away from the edges take the unrolled kernels
+        if (before == after && count > 1 && try_unrolled_sums(tap, w, before, sums, count)) {
+            return;
+        }
+
+        auto center = tap(0);
+        for (auto i = 0u; i < count; i++) sums[i] = w[0] * center[i];
+
+        auto both = std::min(before, after);
+        auto wi = 1;
+        for (; wi <= both; wi++) {
+            auto lower = tap(-wi), upper = tap(wi);
+            for (auto i = 0u; i < count; i++) {
+                sums[i] += w[-wi] * lower[i];
+                sums[i] += w[wi] * upper[i];
+            }
+        }
+        for (; wi <= before; wi++) {
+            auto lower = tap(-wi);
+            for (auto i = 0u; i < count; i++) sums[i] += w[-wi] * lower[i];
+        }
+        for (; wi <= after; wi++) {
+            auto upper = tap(wi);
+            for (auto i = 0u; i < count; i++) sums[i] += w[wi] * upper[i];
+        }
+    }
+
+    // Same with the taps stride apart in memory
+    void weighted_sums(const unsigned char* src, long stride, const double* w, int before, int after, double* sums, unsigned count)
+    {
+        weighted_sums([=](int k) { return src + k * stride; }, w, before, after, sums, count);
+    }
+
+    // Taps of kernel that the sums at position p of a line of size samples take, all of
+    // them when the edges are replicated and the ones inside the line otherwise
+    void get_taps(const Kernel& kernel, int p, unsigned size, int& before, int& after)
+    {
+        before = after = kernel.radius;
+        if (kernel.edge == Edge::renormalize) {
+            before = std::min(before, p);
+            after = std::min(after, static_cast<int>(size) - 1 - p);
+        }
+    }
+
+    // Sum of the weights of the taps inside the line, before of them on the lower side and
+    // after on the upper side, added in the same order as weighted_sums
+    double normalizer(const double* w, int before, int after)
+    {
+        double n = w[0];
+        for (auto wi = 1; wi <= std::max(before, after); wi++) {
+            if (wi <= before) n += w[-wi];
+            if (wi <= after) n += w[wi];
+        }
+        return n;
+    }
+
+    // What the sums at position p of a line of size samples are divided by, 1 for
+    // replicated edges
+    double get_normalizer(const Kernel& kernel, int p, unsigned size)
+    {
+        if (kernel.edge == Edge::replicate) return 1;
+        int before, after;
+        get_taps(kernel, p, size, before, after);
+        return normalizer(kernel.weights.data() + kernel.radius, before, after);
+    }
+
+    // get_normalizer for every position along a line of size samples. Only the radius
+    // positions at each end differ from the interior.
+    std::vector<double> get_normalizers(const Kernel& kernel, unsigned size)
+    {
+        std::vector<double> norms(size);
+        for (auto p = 0; p < static_cast<int>(size); p++) norms[p] = get_normalizer(kernel, p, size);
+        return norms;
+    }
+
+    // Filters the pixels begin .. end of one row of x_size pixels of one channel into out,
+    // which starts at pixel begin. src holds the row from pixel src_begin on, as far as
+    // the taps of the span reach. sums needs room for end - begin values.
+    void filter_span(const unsigned char* src, int src_begin, unsigned char* out, unsigned x_size, int begin, int end, const Kernel& kernel, const double* norms, double* sums)
+    {
+        int radius = kernel.radius, size = x_size;
+        auto w = kernel.weights.data() + radius;
+
+        // the interior [first, last) has every tap inside the row, the rest is border
+        int first = std::clamp(std::min(radius, size), begin, end);
+        int last = std::clamp(std::max(std::min(radius, size), size - radius), first, end);
+
+        weighted_sums(src + (first - src_begin), 1, w, radius, radius, sums, last - first);
+        for (auto i = 0; i < last - first; i++) out[first - begin + i] = clamp_pixel(sums[i] / norms[first + i] + kernel.offset);
+
+        // Border pixels take the taps inside the row and their own normalizer, or read
+        // the edge pixel for the taps outside
+        for (auto x = begin; x < end; x++) {
+            if (x == first) x = last;
+            if (x == end) break;
+            int before, after;
+            get_taps(kernel, x, x_size, before, after);
+            double sum;
+            weighted_sums([&](int k) { return src + (std::clamp(x + k, 0, size - 1) - src_begin); }, w, before, after, &sum, 1);
+            out[x - begin] = clamp_pixel(sum / norms[x] + kernel.offset);
+        }
+    }
+
+    // Filters one row of one channel from src into out, sums needs room for x_size values
+    void filter_row(const unsigned char* src, unsigned char* out, unsigned x_size, const Kernel& kernel, const double* norms, double* sums)
+    {
+        filter_span(src, 0, out, x_size, 0, x_size, kernel, norms, sums);
     }
 
    void* horizontal_blur_worker(void* arg) {
     // Extract thread data
     Thread_Data* tdata = static_cast<Thread_Data*>(arg);
-    const auto R = tdata->R;
-    const auto G = tdata->G;
-    const auto B = tdata->B;
     auto x_size = tdata->x_size;
-    auto y_size = tdata->y_size;
-    auto radius = tdata->radius;
-    const double* w = tdata->weights;
     Matrix& scratch = *tdata->scratch;
     //dst is not used in horizontal blur becuse we write to scratch 
-
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+    unsigned char* outs[]{const_cast<unsigned char*>(scratch.get_R()), const_cast<unsigned char*>(scratch.get_G()), const_cast<unsigned char*>(scratch.get_B())};
+    std::vector<double> sums(x_size);
 
     // Perform horizontal blur on assigned rows
     for (auto y = tdata->start_y; y < tdata->end_y; y++) {
-        unsigned row_base = y * x_size;
-        for (auto x = 0; x < x_size; x++) {
-            double r = w[0] * R[row_base + x];
-            double g = w[0] * G[row_base + x];
-            double b = w[0] * B[row_base + x];
-            double n = w[0];
-            // Apply weights to neighboring pixels
-            for (auto wi = 1; wi <= radius; wi++) {
-                auto wc = w[wi];
-                auto x2 = static_cast<int>(x) - wi;
-                // Check bounds and accumulate weighted values
-                if (x2 >= 0) {
-                    r += wc * R[row_base + x2];
-                    g += wc * G[row_base + x2];
-                    b += wc * B[row_base + x2];
-                    n += wc;
-                }
-                x2 = x + wi;
-                // Check bounds and accumulate weighted values
-                if (x2 < static_cast<int>(x_size)) {
-                    r += wc * R[row_base + x2];
-                    g += wc * G[row_base + x2];
-                    b += wc * B[row_base + x2];
-                    n += wc;
-                }
-            }
-            // Normalize and store in scratch matrix
-            scratch.r(x, y) = r / n;
-            scratch.g(x, y) = g / n;
-            scratch.b(x, y) = b / n;
+        unsigned row_base = y * tdata->stride;
+        for (auto c = 0; c < 3; c++) {
+            filter_row(planes[c] + row_base, outs[c] + row_base, x_size, *tdata->row_kernel, tdata->row_norms, sums.data());
         }
     }
     return nullptr;
@@ -91,98 +445,1055 @@ void* vertical_blur_worker(void* arg) {
     // Extract thread data
     Thread_Data* tdata = static_cast<Thread_Data*>(arg);
     auto x_size = tdata->x_size;
-    auto y_size = tdata->y_size;
-    auto radius = tdata->radius;
-    const double* w = tdata->weights;
+    int y_size = tdata->y_size;
+    auto stride = tdata->stride;
+    const Kernel& kernel = *tdata->column_kernel;
+    const double* w = kernel.weights.data() + kernel.radius;
+    const double* norms = tdata->column_norms;
     Matrix& scratch = *tdata->scratch;
     Matrix& dst = *tdata->dst;
     
     // Direct memory access for efficiency inatead of going through getters , needed pointer to modyfi the data for output
-    auto R = const_cast<unsigned char*>(dst.get_R());
-    auto G = const_cast<unsigned char*>(dst.get_G());
-    auto B = const_cast<unsigned char*>(dst.get_B());
-    // Perform vertical blur on assigned rows
+    const unsigned char* planes[]{scratch.get_R(), scratch.get_G(), scratch.get_B()};
+    unsigned char* outs[]{const_cast<unsigned char*>(dst.get_R()), const_cast<unsigned char*>(dst.get_G()), const_cast<unsigned char*>(dst.get_B())};
+    std::vector<double> sums(std::min(x_size, column_strip));
+
+    // Perform vertical blur on assigned rows one channel and one strip of columns at a
+    // time. The 2 * radius + 1 row segments under the kernel then stay in cache while the
+    // strip moves down, where full rows of all three channels would not at large radii.
+    for (auto c = 0; c < 3; c++) {
+        for (auto x0 = 0u; x0 < x_size; x0 += column_strip) {
+            auto width = std::min(column_strip, x_size - x0);
+            for (int y = tdata->start_y; y < static_cast<int>(tdata->end_y); y++) {
+                // every pixel in the row has the same taps and the same normalizer
+                int before, after;
+                get_taps(kernel, y, y_size, before, after);
+                auto tap = [&](int k) { return planes[c] + std::clamp(y + k, 0, y_size - 1) * stride + x0; };
+                weighted_sums(tap, w, before, after, sums.data(), width);
+                // Normalize and store in destination matrix
+                auto out = outs[c] + y * stride + x0;
+                for (auto x = 0u; x < width; x++) out[x] = clamp_pixel(sums[x] / norms[y] + kernel.offset);
+            }
+        }
+    }
+    return nullptr;
+}
+
+// The taps from before below the center to after above it in the order weighted_sums
+// adds them, nearest first and lower side first, with their weights. Returns how many.
+template <typename Taps>
+unsigned ordered_taps(Taps tap, const double* w, int before, int after, const unsigned char** taps, double* weights) {
+    unsigned n = 0;
+    taps[n] = tap(0);
+    weights[n++] = w[0];
+
+    auto wi = 1;
+    for (; wi <= std::min(before, after); wi++) {
+        taps[n] = tap(-wi);
+        weights[n++] = w[-wi];
+        taps[n] = tap(wi);
+        weights[n++] = w[wi];
+    }
+    for (; wi <= before; wi++) {
+        taps[n] = tap(-wi);
+        weights[n++] = w[-wi];
+    }
+    for (; wi <= after; wi++) {
+        taps[n] = tap(wi);
+        weights[n++] = w[wi];
+    }
+    return n;
+}
+
+// horizontal_blur_worker for packed matrices, all four channels of a pixel at once
+void* packed_horizontal_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    int x_size = tdata->x_size;
+    const Kernel& kernel = *tdata->row_kernel;
+    int radius = kernel.radius;
+    const double* w = kernel.weights.data() + radius;
+    const double* norms = tdata->row_norms;
+    auto outs = const_cast<unsigned char*>(tdata->scratch->get_pixels());
+    std::vector<const unsigned char*> taps(2 * radius + 1);
+    std::vector<double> weights(taps.size());
+
+    // the interior [first, last) has every tap inside the row and one normalizer
+    int first = std::min(radius, x_size);
+    int last = std::max(first, x_size - radius);
+
     for (auto y = tdata->start_y; y < tdata->end_y; y++) {
-        // Process each pixel in the row
-        for (auto x = 0u; x < x_size; x++) {
-            double r = w[0] * scratch.r(x, y);
-            double g = w[0] * scratch.g(x, y);
-            double b = w[0] * scratch.b(x, y);
-            double n = w[0];
-            // Apply weights to neighboring pixels
-
-            for (auto wi = 1; wi <= radius; wi++) {
-                auto wc = w[wi];
-                auto y2 = static_cast<int>(y) - wi;
-                if (y2 >= 0) {
-                    // Check bounds and accumulate weighted values
-                    r += wc * scratch.r(x, y2);
-                    g += wc * scratch.g(x, y2);
-                    b += wc * scratch.b(x, y2);
-                    n += wc;
-                }
-                y2 = y + wi;
-                if (y2 < static_cast<int>(y_size)) {
-                    // Check bounds and accumulate weighted values
-                    r += wc * scratch.r(x, y2);
-                    g += wc * scratch.g(x, y2);
-                    b += wc * scratch.b(x, y2);
-                    n += wc;
+        auto src = tdata->pixels + y * tdata->stride;
+        auto out = outs + y * tdata->stride;
+
+        if (last > first) {
+            auto n = ordered_taps([&](int k) { return src + 4 * (first + k); }, w, radius, radius, taps.data(), weights.data());
+            Packed::convolve(taps.data(), weights.data(), n, norms[first], kernel.offset, out + 4 * first, last - first);
+        }
+
+        for (auto x = 0; x < x_size; x++) {
+            if (x == first) x = last;
+            if (x == x_size) break;
+            int before, after;
+            get_taps(kernel, x, x_size, before, after);
+            auto n = ordered_taps([&](int k) { return src + 4 * std::clamp(x + k, 0, x_size - 1); }, w, before, after, taps.data(), weights.data());
+            Packed::convolve(taps.data(), weights.data(), n, norms[x], kernel.offset, out + 4 * x, 1);
+        }
+    }
+    return nullptr;
+}
+
+// vertical_blur_worker for packed matrices, in strips of the same number of bytes
+void* packed_vertical_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    int y_size = tdata->y_size;
+    auto stride = tdata->stride;
+    const Kernel& kernel = *tdata->column_kernel;
+    const double* w = kernel.weights.data() + kernel.radius;
+    const double* norms = tdata->column_norms;
+    auto src = tdata->scratch->get_pixels();
+    auto outs = const_cast<unsigned char*>(tdata->dst->get_pixels());
+    std::vector<const unsigned char*> taps(2 * kernel.radius + 1);
+    std::vector<double> weights(taps.size());
+
+    for (auto x0 = 0u; x0 < x_size; x0 += column_strip / 4) {
+        auto width = std::min(column_strip / 4, x_size - x0);
+        for (int y = tdata->start_y; y < static_cast<int>(tdata->end_y); y++) {
+            int before, after;
+            get_taps(kernel, y, y_size, before, after);
+            auto tap = [&](int k) { return src + std::clamp(y + k, 0, y_size - 1) * stride + 4ul * x0; };
+            auto n = ordered_taps(tap, w, before, after, taps.data(), weights.data());
+            Packed::convolve(taps.data(), weights.data(), n, norms[y], kernel.offset, outs + y * stride + 4ul * x0, width);
+        }
+    }
+    return nullptr;
+}
+
+// Horizontally filtered rows of the three channels waiting for the vertical pass, the
+// last rows of them. Row y stays until row y + rows replaces it, which with rows at
+// 2 * radius + 1 is after the last output row that reads it.
+class Row_Ring
+{
+private:
+    unsigned rows;
+    unsigned x_size;
+    unsigned y_size;
+    std::vector<unsigned char> data;
+
+public:
+    Row_Ring(unsigned rows, unsigned x_size, unsigned y_size)
+        : rows{rows}
+        , x_size{x_size}
+        , y_size{y_size}
+        , data(3ul * rows * x_size)
+    {
+    }
+
+    unsigned char* row(int c, unsigned y)
+    {
+        return data.data() + (c * rows + y % rows) * static_cast<size_t>(x_size);
+    }
+
+    // Last row that has to be in the ring before output row y can be filtered
+    unsigned last_needed(const Kernel& kernel, unsigned y) const
+    {
+        return std::min(y + kernel.radius, y_size - 1);
+    }
+
+    // Filters output row y of channel c vertically into out, sums needs room for x_size values
+    void filter_column(int c, int y, const Kernel& kernel, unsigned char* out, double* sums)
+    {
+        int before, after;
+        get_taps(kernel, y, y_size, before, after);
+        auto norm = get_normalizer(kernel, y, y_size);
+        auto tap = [&](int k) { return static_cast<const unsigned char*>(row(c, std::clamp(y + k, 0, static_cast<int>(y_size) - 1))); };
+
+        weighted_sums(tap, kernel.weights.data() + kernel.radius, before, after, sums, x_size);
+        for (auto x = 0u; x < x_size; x++) out[x] = clamp_pixel(sums[x] / norm + kernel.offset);
+    }
+};
+
+// Runs stages one after the other a row at a time. Every stage keeps a Row_Ring of the
+// rows its horizontal pass made, and its vertical pass pulls the rows it needs out of
+// the stage before it as it goes, so the images between stages are never stored whole
+// and stay in cache. Rows must be asked for in increasing order, every stage then makes
+// each of its rows once. Only the columns asked for are made, and of the stages before
+// the last only the columns the stage after them reads.
+class Cascade
+{
+public:
+    // Points rows at row y of the r, g and b planes of the input
+    using Source = std::function<void(unsigned y, const unsigned char* rows[3])>;
+    // Called with each row y that stage k before the last makes, its columns
+    // begin .. end in rows
+    using Sink = std::function<void(unsigned k, unsigned y, const unsigned char* const rows[3])>;
+
+private:
+    struct Level {
+        const Stage* stage;
+        // the columns of the stage's rows that are made
+        int begin, end;
+        std::vector<double> row_norms;
+        Row_Ring ring;
+        // next row to filter horizontally, set by the first row asked for
+        bool started;
+        unsigned next;
+        // the stage's output row on its way into the next stage
+        std::vector<unsigned char> out;
+    };
+
+    unsigned x_size;
+    Source source;
+    Sink sink;
+    std::vector<Level> levels;
+    std::vector<double> sums;
+
+    // Makes output row y of stage k into out
+    void make(unsigned k, unsigned y, unsigned char* const out[3])
+    {
+        auto& level = levels[k];
+        const Stage& stage = *level.stage;
+
+        if (!level.started) {
+            level.next = y - std::min(y, static_cast<unsigned>(stage.vertical.radius));
+            level.started = true;
+        }
+
+        for (; level.next <= level.ring.last_needed(stage.vertical, y); level.next++) {
+            const unsigned char* rows[3];
+            // column the rows start at
+            int rows_begin = 0;
+            if (k == 0) {
+                source(level.next, rows);
+            } else {
+                auto& before = levels[k - 1];
+                auto in = before.out.data();
+                size_t width = before.end - before.begin;
+                unsigned char* const ins[]{in, in + width, in + 2 * width};
+                make(k - 1, level.next, ins);
+                std::copy(ins, ins + 3, rows);
+                rows_begin = before.begin;
+            }
+            for (auto c = 0; c < 3; c++) {
+                filter_span(rows[c], rows_begin, level.ring.row(c, level.next), x_size, level.begin, level.end, stage.horizontal, level.row_norms.data(), sums.data());
+            }
+        }
+
+        for (auto c = 0; c < 3; c++) {
+            level.ring.filter_column(c, y, stage.vertical, out[c], sums.data());
+        }
+        if (sink && k + 1 < levels.size()) {
+            sink(k, y, out);
+        }
+    }
+
+public:
+    // Makes columns begin .. end of the output rows
+    Cascade(const std::vector<Stage>& stages, unsigned x_size, unsigned y_size, Source source, unsigned begin, unsigned end, Sink sink = {})
+        : x_size{x_size}
+        , source{source}
+        , sink{sink}
+        , sums(x_size)
+    {
+        // each stage makes the columns of the stage after it widened by that stage's
+        // horizontal radius, clipped to the image
+        std::vector<int> begins(stages.size(), begin), ends(stages.size(), end);
+        for (auto k = stages.size(); k-- > 1;) {
+            begins[k - 1] = std::max(begins[k] - stages[k].horizontal.radius, 0);
+            ends[k - 1] = std::min(ends[k] + stages[k].horizontal.radius, static_cast<int>(x_size));
+        }
+
+        for (auto k = 0u; k < stages.size(); k++) {
+            auto& stage = stages[k];
+            unsigned width = ends[k] - begins[k];
+            auto rows = std::min(2 * static_cast<unsigned>(stage.vertical.radius) + 1, y_size);
+            levels.push_back({&stage, begins[k], ends[k], get_normalizers(stage.horizontal, x_size), Row_Ring{rows, width, y_size}, false, 0, std::vector<unsigned char>(3ul * width)});
+        }
+    }
+
+    // Makes output row y of the last stage into the r, g and b rows in out
+    void operator()(unsigned y, unsigned char* const out[3])
+    {
+        make(levels.size() - 1, y, out);
+    }
+};
+
+// Every stage of the chain over the band of rows start_y .. end_y of dst without waiting
+// for other threads. dst is the region at origin_x, origin_y of the input, which is
+// read as far around it as the stages reach. Rows above and below the band that the
+// stages need are filtered by this thread as well, so neighbouring bands redo up to the
+// sum of the radii of rows per stage but never wait for each other.
+void* chain_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto stride = tdata->stride;
+    Matrix& dst = *tdata->dst;
+    auto dst_stride = dst.get_stride();
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+    unsigned char* outs[]{const_cast<unsigned char*>(dst.get_R()), const_cast<unsigned char*>(dst.get_G()), const_cast<unsigned char*>(dst.get_B())};
+
+    Cascade cascade{*tdata->stages, x_size, tdata->y_size, [&](unsigned y, const unsigned char* rows[3]) {
+        for (auto c = 0; c < 3; c++) rows[c] = planes[c] + static_cast<size_t>(y) * stride;
+    }, tdata->origin_x, tdata->origin_x + dst.get_x_size()};
+
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        unsigned char* const out[]{outs[0] + y * dst_stride, outs[1] + y * dst_stride, outs[2] + y * dst_stride};
+        cascade(tdata->origin_y + y, out);
+    }
+    return nullptr;
+}
+
+// Every stage of a stack on its own over the band of rows start_y .. end_y, stage k
+// into output k. Each input row is filtered horizontally by all stages while it is in
+// cache, into a Row_Ring for each, and every stage makes its output rows as soon as its
+// ring has the rows they need.
+void* stack_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto y_size = tdata->y_size;
+    auto stride = tdata->stride;
+    auto start = tdata->start_y, end = tdata->end_y;
+    auto& stages = *tdata->stages;
+    auto& outputs = *tdata->outputs;
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+
+    if (start >= end) {
+        return nullptr;
+    }
+
+    struct Level {
+        std::vector<double> row_norms;
+        Row_Ring ring;
+        // input rows the stage reads for the band, and its next output row
+        unsigned first, last;
+        unsigned next;
+    };
+
+    std::vector<Level> levels;
+    unsigned first = y_size, last = 0;
+    for (auto& stage : stages) {
+        unsigned radius = stage.vertical.radius;
+        auto rows = std::min(2 * radius + 1, y_size);
+        Level level{get_normalizers(stage.horizontal, x_size), Row_Ring{rows, x_size, y_size}, start - std::min(start, radius), std::min(end - 1 + radius, y_size - 1), start};
+        first = std::min(first, level.first);
+        last = std::max(last, level.last);
+        levels.push_back(std::move(level));
+    }
+
+    std::vector<double> sums(x_size);
+    for (auto y = first; y <= last; y++) {
+        for (auto k = 0u; k < levels.size(); k++) {
+            auto& level = levels[k];
+            if (y < level.first || y > level.last) {
+                continue;
+            }
+            for (auto c = 0; c < 3; c++) {
+                filter_row(planes[c] + static_cast<size_t>(y) * stride, level.ring.row(c, y), x_size, stages[k].horizontal, level.row_norms.data(), sums.data());
+            }
+        }
+
+        for (auto k = 0u; k < levels.size(); k++) {
+            auto& level = levels[k];
+            auto& dst = outputs[k];
+            unsigned char* outs[]{const_cast<unsigned char*>(dst.get_R()), const_cast<unsigned char*>(dst.get_G()), const_cast<unsigned char*>(dst.get_B())};
+            for (; level.next < end && level.ring.last_needed(stages[k].vertical, level.next) <= y; level.next++) {
+                for (auto c = 0; c < 3; c++) {
+                    level.ring.filter_column(c, level.next, stages[k].vertical, outs[c] + static_cast<size_t>(level.next) * stride, sums.data());
                 }
             }
-            // Normalize and store in destination matrix
+        }
+    }
+    return nullptr;
+}
+
+// The stages of a stack one after the other over the band of rows start_y .. end_y as a
+// chain, keeping the rows every stage makes in its output instead of only the last
+void* cascaded_stack_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto stride = tdata->stride;
+    auto start = tdata->start_y, end = tdata->end_y;
+    auto& outputs = *tdata->outputs;
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+
+    auto output_row = [&](unsigned k, unsigned y, int c) {
+        auto& dst = outputs[k];
+        auto plane = c == 0 ? dst.get_R() : c == 1 ? dst.get_G() : dst.get_B();
+        return const_cast<unsigned char*>(plane) + static_cast<size_t>(y) * stride;
+    };
+
+    // the stages before the last also make the rows around the band the ones after
+    // them read, only the band's own are kept
+    Cascade cascade{*tdata->stages, x_size, tdata->y_size, [&](unsigned y, const unsigned char* rows[3]) {
+        for (auto c = 0; c < 3; c++) rows[c] = planes[c] + static_cast<size_t>(y) * stride;
+    }, 0, x_size, [&](unsigned k, unsigned y, const unsigned char* const rows[3]) {
+        if (y >= start && y < end) {
+            for (auto c = 0; c < 3; c++) std::copy(rows[c], rows[c] + x_size, output_row(k, y, c));
+        }
+    }};
+
+    for (auto y = start; y < end; y++) {
+        auto k = outputs.size() - 1;
+        unsigned char* const out[]{output_row(k, y, 0), output_row(k, y, 1), output_row(k, y, 2)};
+        cascade(y, out);
+    }
+    return nullptr;
+}
+
+// Runs the thread's task_worker on bands of rows or columns taken from the queues
+// until there are none left
+void* stealing_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto band_size = tdata->task_columns ? line_strip : steal_rows;
+    auto size = tdata->task_columns ? tdata->x_size : tdata->y_size;
+    Thread_Data band = *tdata;
+    unsigned task;
+
+    while (tdata->queues->next(tdata->thread, task)) {
+        auto begin = task * band_size, end = std::min(begin + band_size, size);
+        if (tdata->task_columns) {
+            band.start_x = begin;
+            band.end_x = end;
+        } else {
+            band.start_y = begin;
+            band.end_y = end;
+        }
+        tdata->task_worker(&band);
+    }
+    return nullptr;
+}
+
+void* line_horizontal_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    Matrix& scratch = *tdata->scratch;
+    // one row with r, g and b side by side so the filter runs over all three at once
+    auto line_size = (x_size + 2 * line_padding) * 3;
+    std::vector<double> line(2 * line_size);
+
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        unsigned row_base = y * tdata->stride;
+        for (auto x = 0u; x < x_size; x++) {
+            line[(x + line_padding) * 3] = tdata->R[row_base + x];
+            line[(x + line_padding) * 3 + 1] = tdata->G[row_base + x];
+            line[(x + line_padding) * 3 + 2] = tdata->B[row_base + x];
+        }
+
+        tdata->line_filter(line.data(), line.data() + line_size, x_size, 3, tdata->weights);
+
+        for (auto x = 0u; x < x_size; x++) {
+            scratch.r(x, y) = to_pixel(line[(x + line_padding) * 3]);
+            scratch.g(x, y) = to_pixel(line[(x + line_padding) * 3 + 1]);
+            scratch.b(x, y) = to_pixel(line[(x + line_padding) * 3 + 2]);
+        }
+    }
+    return nullptr;
+}
+
+void* line_vertical_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto y_size = tdata->y_size;
+    Matrix& scratch = *tdata->scratch;
+    Matrix& dst = *tdata->dst;
+    // a strip of columns for all three channels, walked top to bottom row by row
+    auto strip_size = (y_size + 2 * line_padding) * 3 * line_strip;
+    std::vector<double> strip(2 * strip_size);
+
+    for (auto x0 = tdata->start_x; x0 < tdata->end_x; x0 += line_strip) {
+        auto width = std::min(line_strip, tdata->end_x - x0);
+        auto lanes = 3 * width;
+
+        for (auto y = 0u; y < y_size; y++) {
+            auto row = strip.data() + (y + line_padding) * lanes;
+            for (auto i = 0u; i < width; i++) {
+                row[i] = scratch.r(x0 + i, y);
+                row[width + i] = scratch.g(x0 + i, y);
+                row[2 * width + i] = scratch.b(x0 + i, y);
+            }
+        }
+
+        tdata->line_filter(strip.data(), strip.data() + strip_size, y_size, lanes, tdata->weights);
+
+        for (auto y = 0u; y < y_size; y++) {
+            auto row = strip.data() + (y + line_padding) * lanes;
+            for (auto i = 0u; i < width; i++) {
+                dst.r(x0 + i, y) = to_pixel(row[i]);
+                dst.g(x0 + i, y) = to_pixel(row[width + i]);
+                dst.b(x0 + i, y) = to_pixel(row[2 * width + i]);
+            }
+        }
+    }
+    return nullptr;
+}
+
+void* fixed_horizontal_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto radius = static_cast<unsigned>(tdata->radius);
+    const Fixed::Table& table = *tdata->row_table;
+    Matrix& scratch = *tdata->scratch;
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+    unsigned char* outs[]{const_cast<unsigned char*>(scratch.get_R()), const_cast<unsigned char*>(scratch.get_G()), const_cast<unsigned char*>(scratch.get_B())};
+    std::vector<const unsigned char*> taps(table.taps());
+
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        for (auto c = 0; c < 3; c++) {
+            auto src = planes[c] + y * tdata->stride;
+            auto out = outs[c] + y * tdata->stride;
+
+            // the interior has every tap inside the row and runs through the SIMD kernel,
+            // tap j of output x is pixel x - radius + j so it starts at src + j
+            if (x_size > 2 * radius) {
+                for (auto j = 0u; j < taps.size(); j++) taps[j] = src + std::min(j, 2 * radius);
+                Fixed::convolve(taps.data(), table.at(radius), taps.size(), out + radius, x_size - 2 * radius);
+            }
 
-            R[y * x_size + x] = r / n;
-            G[y * x_size + x] = g / n;
-            B[y * x_size + x] = b / n;
+            // the few pixels near the edges use their own renormalized tables
+            for (auto x = 0u; x < x_size; x++) {
+                if (x == radius && x_size > 2 * radius) x = x_size - radius;
+                auto w = table.at(x) + radius;
+                int before = std::min(x, radius), after = std::min(x_size - 1 - x, radius);
+                int32_t acc = 0;
+                for (auto k = -before; k <= after; k++) acc += w[k] * src[x + k];
+                out[x] = acc >> Fixed::shift;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void* fixed_vertical_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto y_size = tdata->y_size;
+    auto radius = tdata->radius;
+    const Fixed::Table& table = *tdata->column_table;
+    Matrix& scratch = *tdata->scratch;
+    Matrix& dst = *tdata->dst;
+    const unsigned char* planes[]{scratch.get_R(), scratch.get_G(), scratch.get_B()};
+    unsigned char* outs[]{const_cast<unsigned char*>(dst.get_R()), const_cast<unsigned char*>(dst.get_G()), const_cast<unsigned char*>(dst.get_B())};
+    std::vector<const unsigned char*> taps(table.taps());
+
+    // every pixel of a row shares the row's table, so even the edge rows run through
+    // the SIMD kernel, rows outside the image carry zero weight and are just clamped
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        for (auto c = 0; c < 3; c++) {
+            for (auto j = 0u; j < taps.size(); j++) {
+                auto y2 = std::clamp(static_cast<int>(y) - radius + static_cast<int>(j), 0, static_cast<int>(y_size) - 1);
+                taps[j] = planes[c] + y2 * tdata->stride;
+            }
+            Fixed::convolve(taps.data(), table.at(y), taps.size(), outs[c] + y * tdata->stride, x_size);
         }
     }
     return nullptr;
 }
 
-Matrix blur(Matrix m, const int radius, const int threadscount) {
+void* float32_horizontal_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    int x_size = tdata->x_size;
+    int radius = tdata->radius;
+    const Float32::Table& table = *tdata->row_floats;
+    Matrix& scratch = *tdata->scratch;
+    const unsigned char* planes[]{tdata->R, tdata->G, tdata->B};
+    unsigned char* outs[]{const_cast<unsigned char*>(scratch.get_R()), const_cast<unsigned char*>(scratch.get_G()), const_cast<unsigned char*>(scratch.get_B())};
+    std::vector<const unsigned char*> taps(table.taps());
+
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        for (auto c = 0; c < 3; c++) {
+            auto src = planes[c] + y * tdata->stride;
+            auto out = outs[c] + y * tdata->stride;
+
+            // the interior has every tap inside the row, tap j of output x is pixel
+            // x - radius + j so it starts at src + j
+            if (x_size > 2 * radius) {
+                for (auto j = 0u; j < taps.size(); j++) taps[j] = src + j;
+                Float32::convolve(taps.data(), table.at(radius), taps.size(), out + radius, x_size - 2 * radius);
+            }
+
+            // the few pixels near the edges use their own tables, taps outside the row
+            // carry zero weight and are just clamped
+            for (auto x = 0; x < x_size; x++) {
+                if (x == radius && x_size > 2 * radius) x = x_size - radius;
+                for (auto j = 0u; j < taps.size(); j++) taps[j] = src + std::clamp(x - radius + static_cast<int>(j), 0, x_size - 1);
+                Float32::convolve(taps.data(), table.at(x), taps.size(), out + x, 1);
+            }
+        }
+    }
+    return nullptr;
+}
+
+void* float32_vertical_worker(void* arg) {
+    Thread_Data* tdata = static_cast<Thread_Data*>(arg);
+    auto x_size = tdata->x_size;
+    auto y_size = tdata->y_size;
+    auto radius = tdata->radius;
+    const Float32::Table& table = *tdata->column_floats;
+    Matrix& scratch = *tdata->scratch;
+    Matrix& dst = *tdata->dst;
+    const unsigned char* planes[]{scratch.get_R(), scratch.get_G(), scratch.get_B()};
+    unsigned char* outs[]{const_cast<unsigned char*>(dst.get_R()), const_cast<unsigned char*>(dst.get_G()), const_cast<unsigned char*>(dst.get_B())};
+    std::vector<const unsigned char*> taps(table.taps());
+
+    // every pixel of a row shares the row's table like in fixed_vertical_worker
+    for (auto y = tdata->start_y; y < tdata->end_y; y++) {
+        for (auto c = 0; c < 3; c++) {
+            for (auto j = 0u; j < taps.size(); j++) {
+                auto y2 = std::clamp(static_cast<int>(y) - radius + static_cast<int>(j), 0, static_cast<int>(y_size) - 1);
+                taps[j] = planes[c] + y2 * tdata->stride;
+            }
+            Float32::convolve(taps.data(), table.at(y), taps.size(), outs[c] + y * tdata->stride, x_size);
+        }
+    }
+    return nullptr;
+}
+
+Matrix blur(const Matrix& m, const int radius, const int threadscount, Mode mode, Schedule schedule) {
+    Matrix scratch{};
+    return blur(m, radius, threadscount, scratch, mode, schedule);
+}
+
+Matrix blur(const Matrix& m, const int radius, const int threadscount, Matrix& scratch, Mode mode, Schedule schedule) {
+    Pool pool{static_cast<unsigned>(threadscount)};
+    return blur(m, radius, pool, scratch, mode, schedule);
+}
+
+// One copy of base for each thread of pool, with its slice of the y_size rows and of the
+// x_size columns
+std::vector<Thread_Data> get_slices(const Thread_Data& base, const Pool& pool, unsigned x_size, unsigned y_size) {
+    const int threadscount = pool.size();
+    std::vector<Thread_Data> tdata(threadscount, base);
+
+    // Divide work among threads
+    unsigned slice = y_size / threadscount;
+    unsigned column_slice = x_size / threadscount;
+    for (int t = 0; t < threadscount; t++) {
+        // static_cast to avoid warnings
+        tdata[t].start_y = static_cast<unsigned>(t * slice);
+        tdata[t].end_y = static_cast<unsigned>((t == threadscount - 1) ? y_size : (t + 1) * slice);
+        tdata[t].start_x = static_cast<unsigned>(t * column_slice);
+        tdata[t].end_x = static_cast<unsigned>((t == threadscount - 1) ? x_size : (t + 1) * column_slice);
+        tdata[t].thread = static_cast<unsigned>(t);
+    }
+    return tdata;
+}
+
+// Runs horizontal and then vertical on pool as schedule says. Schedule::pipelined is
+// left to convolve and runs as passes here.
+void run_passes(const Thread_Data& base, Pool& pool, void* (*horizontal)(void*), void* (*vertical)(void*), Schedule schedule) {
+    const auto x_size = base.x_size;
+    const auto y_size = base.y_size;
+    auto tdata = get_slices(base, pool, x_size, y_size);
+
+    if (schedule == Schedule::stealing) {
+        // one job per pass, the pool returning is the barrier between them
+        Task_Queues queues{pool.size()};
+        for (auto worker : {horizontal, vertical}) {
+            // the line based vertical pass splits the image into columns
+            auto columns = worker == line_vertical_worker;
+            auto band_size = columns ? line_strip : steal_rows;
+            auto size = columns ? x_size : y_size;
+            queues.fill((size + band_size - 1) / band_size);
+            for (auto& data : tdata) {
+                data.task_worker = worker;
+                data.task_columns = columns;
+                data.queues = &queues;
+            }
+            pool.run({stealing_worker}, tdata.data());
+        }
+    } else {
+        // the vertical pass reads rows of scratch other threads wrote, the pool's barrier
+        // between the phases keeps it from starting before they are all done
+        pool.run({horizontal, vertical}, tdata.data());
+    }
+}
+
+Matrix convolve(const Matrix& m, const std::vector<Stage>& stages, Pool& pool) {
+    return convolve(MatrixView{m}, stages, pool);
+}
+
+// rect, which starts inside the x_size * y_size image, clipped to it and widened on
+// every side by as far as the stages read, the sum of their radii
+Rect get_reach(const Rect& rect, const std::vector<Stage>& stages, unsigned x_size, unsigned y_size) {
+    unsigned reach_x = 0, reach_y = 0;
+    for (auto& stage : stages) {
+        reach_x += stage.horizontal.radius;
+        reach_y += stage.vertical.radius;
+    }
+
+    auto x = rect.x - std::min(rect.x, reach_x), y = rect.y - std::min(rect.y, reach_y);
+    auto x_end = rect.x + std::min(rect.x_size, x_size - rect.x), y_end = rect.y + std::min(rect.y_size, y_size - rect.y);
+    x_end += std::min(reach_x, x_size - x_end);
+    y_end += std::min(reach_y, y_size - y_end);
+    return {x, y, x_end - x, y_end - y};
+}
+
+Matrix convolve(const MatrixView& view, const std::vector<Stage>& stages, Pool& pool) {
+    const Matrix& m = view.get_parent();
+
+    if (stages.empty()) {
+        return Matrix{view};
+    }
+
+    // the chain works on planes, packed matrices take a detour through planar. Only the
+    // region and what the stages read around it are converted, inside that the stages
+    // see the same pixels and image edges as in the whole parent.
+    if (m.get_layout() == Matrix::Layout::packed) {
+        auto margin = get_reach({view.get_x(), view.get_y(), view.get_x_size(), view.get_y_size()}, stages, m.get_x_size(), m.get_y_size());
+        Matrix planar{MatrixView{m, margin.x, margin.y, margin.x_size, margin.y_size}, Matrix::Layout::planar};
+        MatrixView region{planar, view.get_x() - margin.x, view.get_y() - margin.y, view.get_x_size(), view.get_y_size()};
+        return Matrix{convolve(region, stages, pool), Matrix::Layout::packed};
+    }
+
+    Matrix dst{view.get_x_size(), view.get_y_size(), m.get_color_max()};
+
+    Thread_Data base{};
+    base.dst = &dst;
+    base.R = m.get_R();
+    base.G = m.get_G();
+    base.B = m.get_B();
+    base.x_size = m.get_x_size();
+    base.stride = m.get_stride();
+    base.y_size = m.get_y_size();
+    base.origin_x = view.get_x();
+    base.origin_y = view.get_y();
+    base.stages = &stages;
+
+    auto tdata = get_slices(base, pool, view.get_x_size(), view.get_y_size());
+    pool.run({chain_worker}, tdata.data());
+
+    return dst;
+}
+
+Matrix blur(const MatrixView& view, const int radius, Pool& pool) {
+    auto kernel = Gauss::get_kernel(radius);
+    return convolve(view, {Stage{kernel, kernel}}, pool);
+}
+
+Matrix convolve(const Matrix& m, const Kernel& horizontal, const Kernel& vertical, Pool& pool, Matrix& scratch, Schedule schedule) {
+    auto packed = m.get_layout() == Matrix::Layout::packed;
+
+    // pipelined is a chain of one stage and doesn't use scratch, packed matrices run it
+    // as passes
+    if (schedule == Schedule::pipelined && !packed) {
+        return convolve(m, {Stage{horizontal, vertical}}, pool);
+    }
+
+    const auto x_size = m.get_x_size();
+    const auto y_size = m.get_y_size();
+    Matrix dst{x_size, y_size, m.get_color_max(), m.get_layout()};
+
+    // scratch only has to hold this image, not PPM::max_dimension squared, in its layout
+    if (scratch.get_layout() == m.get_layout()) {
+        scratch.resize(x_size, y_size);
+    } else {
+        scratch = Matrix{x_size, y_size, m.get_color_max(), m.get_layout()};
+    }
+
+    // Normalizers for the direct passes, the border positions differ from the interior
+    auto row_norms = get_normalizers(horizontal, x_size);
+    auto column_norms = get_normalizers(vertical, y_size);
+
+    Thread_Data base{};
+    base.dst = &dst;
+    base.scratch = &scratch;
+    base.R = m.get_R();
+    base.G = m.get_G();
+    base.B = m.get_B();
+    base.pixels = m.get_pixels();
+    base.x_size = x_size;
+    base.stride = m.get_stride();
+    base.y_size = y_size;
+    base.row_kernel = &horizontal;
+    base.column_kernel = &vertical;
+    base.row_norms = row_norms.data();
+    base.column_norms = column_norms.data();
+
+    if (packed) {
+        run_passes(base, pool, packed_horizontal_worker, packed_vertical_worker, schedule);
+    } else {
+        run_passes(base, pool, horizontal_blur_worker, vertical_blur_worker, schedule);
+    }
+
+    return dst;
+}
+
+Matrix blur(const Matrix& m, const int radius, Pool& pool, Matrix& scratch, Mode mode, Schedule schedule) {
+    // only gauss has a packed kernel, the other modes take a detour through planar
+    if (mode != Mode::gauss && m.get_layout() == Matrix::Layout::packed) {
+        // the planar passes turn scratch planar, so it keeps being reused across calls
+        return Matrix{blur(Matrix{m, Matrix::Layout::planar}, radius, pool, scratch, mode, schedule), Matrix::Layout::packed};
+    }
+
 
     //compute them only once
     //key optimization points are precomputing weights only once
     //and using a scratch matrix to avoid repeated allocations
     // use direct memory access via cached pointers like r, g, b arrays
-    Matrix scratch{PPM::max_dimension};
-    auto dst{m};
     // Precompute Gaussian weights
     double weights[Gauss::max_radius]{};
     Gauss::get_weights(radius, weights);
 
     // Get image dimensions 
-    const auto x_size = dst.get_x_size();
-    const auto y_size = dst.get_y_size();
-    // Direct memory access for efficiency inatead of going through getters
-    // xosnt beacuse we dont want to modify the original data
-    unsigned char* R = const_cast<unsigned char*>(dst.get_R());
-    unsigned char* G = const_cast<unsigned char*>(dst.get_G());
-    unsigned char* B = const_cast<unsigned char*>(dst.get_B());
+    const auto x_size = m.get_x_size();
+    const auto y_size = m.get_y_size();
 
-    pthread_t threads[threadscount];
-    Thread_Data tdata[threadscount];
-    
+    // The line based modes replace the weights with their own parameters
+    double params[4]{};
+    const double* pass_weights = weights;
+    Line_Filter line_filter = nullptr;
+    void* (*horizontal)(void*) = nullptr;
+    void* (*vertical)(void*) = nullptr;
 
-    // Divide work among threads
-    unsigned slice = y_size / threadscount;
-    for (int t = 0; t < threadscount; t++) {
-        // Set up thread data
-        // static_cast to avoid warnings
-        tdata[t] = {static_cast<unsigned>(t * slice),
-            static_cast<unsigned>((t == threadscount - 1) ? y_size : (t + 1) * slice)
-            ,&dst, &scratch, R, G, B, weights, radius, x_size, y_size};
-        pthread_create(&threads[t], nullptr, horizontal_blur_worker, &tdata[t]);
+    if (mode == Mode::iir && radius >= Gauss::min_recursive_radius) {
+        Gauss::get_recursive_coefficients(Gauss::sigma(radius), params);
+        line_filter = recursive_lines;
+    } else if (mode == Mode::box && radius >= Gauss::min_box_radius) {
+        int radii[Gauss::box_passes]{};
+        Gauss::get_box_radii(Gauss::sigma(radius), radii);
+        std::copy(radii, radii + Gauss::box_passes, params);
+        line_filter = box_lines;
     }
-    // Wait for all threads to finish
-    for (int t = 0; t < threadscount; t++) pthread_join(threads[t], nullptr);
 
-    for (int t = 0; t < threadscount; t++) {
-        pthread_create(&threads[t], nullptr, vertical_blur_worker, &tdata[t]);
+    if (line_filter) {
+        pass_weights = params;
+        horizontal = line_horizontal_worker;
+        vertical = line_vertical_worker;
+    }
+
+    // Q15 tables for the fixed point mode, empty for the others
+    std::vector<Fixed::Table> fixed_tables;
+
+    // a line of one pixel has a lone tap of weight 1, out of Q15's range, and is left
+    // to the direct kernel
+    if (mode == Mode::fixed && radius >= 1 && x_size > 1 && y_size > 1) {
+        fixed_tables.emplace_back(weights, radius, x_size);
+        fixed_tables.emplace_back(weights, radius, y_size);
+        horizontal = fixed_horizontal_worker;
+        vertical = fixed_vertical_worker;
+    }
+
+    // single precision tables for the float32 mode
+    std::vector<Float32::Table> float_tables;
+
+    if (mode == Mode::float32 && radius >= 1) {
+        float_tables.emplace_back(weights, radius, x_size);
+        float_tables.emplace_back(weights, radius, y_size);
+        horizontal = float32_horizontal_worker;
+        vertical = float32_vertical_worker;
     }
-    for (int t = 0; t < threadscount; t++) pthread_join(threads[t], nullptr);
+
+    // gauss, and the modes that fall back to it at small radii, is the direct kernel
+    if (!horizontal) {
+        auto kernel = Gauss::get_kernel(radius);
+        return convolve(m, kernel, kernel, pool, scratch, schedule);
+    }
+
+    // the input is only read, so dst just needs the right size and not a copy of m
+    Matrix dst{x_size, y_size, m.get_color_max()};
+
+    // the passes index scratch's planes, a packed scratch from another call has none
+    if (scratch.get_layout() == Matrix::Layout::planar) {
+        scratch.resize(x_size, y_size);
+    } else {
+        scratch = Matrix{x_size, y_size, m.get_color_max()};
+    }
+
+    Thread_Data base{};
+    base.dst = &dst;
+    base.scratch = &scratch;
+    // Direct memory access for efficiency inatead of going through getters
+    // const beacuse the horizontal pass reads the input without modifying it
+    base.R = m.get_R();
+    base.G = m.get_G();
+    base.B = m.get_B();
+    base.weights = pass_weights;
+    base.radius = radius;
+    base.x_size = x_size;
+    base.stride = m.get_stride();
+    base.y_size = y_size;
+    base.line_filter = line_filter;
+    base.row_table = fixed_tables.empty() ? nullptr : &fixed_tables[0];
+    base.column_table = fixed_tables.empty() ? nullptr : &fixed_tables[1];
+    base.row_floats = float_tables.empty() ? nullptr : &float_tables[0];
+    base.column_floats = float_tables.empty() ? nullptr : &float_tables[1];
+
+    run_passes(base, pool, horizontal, vertical, schedule);
 
     return dst;
 }
-};
\ No newline at end of file
+
+std::vector<Matrix> convolve_stack(const Matrix& m, const std::vector<Stage>& stages, Pool& pool, Stack stack) {
+    if (stages.empty()) {
+        return {};
+    }
+
+    // the stack works on planes, packed matrices take a detour through planar
+    if (m.get_layout() == Matrix::Layout::packed) {
+        auto outputs = convolve_stack(Matrix{m, Matrix::Layout::planar}, stages, pool, stack);
+        for (auto& output : outputs) output = Matrix{output, Matrix::Layout::packed};
+        return outputs;
+    }
+
+    std::vector<Matrix> outputs;
+    for (auto k = 0u; k < stages.size(); k++) {
+        outputs.emplace_back(m.get_x_size(), m.get_y_size(), m.get_color_max());
+    }
+
+    Thread_Data base{};
+    base.R = m.get_R();
+    base.G = m.get_G();
+    base.B = m.get_B();
+    base.x_size = m.get_x_size();
+    base.stride = m.get_stride();
+    base.y_size = m.get_y_size();
+    base.stages = &stages;
+    base.outputs = &outputs;
+
+    auto tdata = get_slices(base, pool, base.x_size, base.y_size);
+    pool.run({stack == Stack::cascaded ? cascaded_stack_worker : stack_worker}, tdata.data());
+
+    return outputs;
+}
+
+std::vector<Matrix> blur_stack(const Matrix& m, const std::vector<int>& radii, Pool& pool, Stack stack) {
+    std::vector<Stage> stages;
+    for (auto radius : radii) {
+        auto kernel = Gauss::get_kernel(radius);
+        stages.push_back({kernel, kernel});
+    }
+    return convolve_stack(m, stages, pool, stack);
+}
+
+// Adds rect to rects, merged with those it overlaps as long as their bounding box is no
+// bigger than the two of them apart, so overlapping rectangles are not filtered twice
+// but two thin ones crossing are not turned into the square around them
+void add_rect(std::vector<Rect>& rects, Rect rect) {
+    auto area = [](const Rect& r) { return static_cast<size_t>(r.x_size) * r.y_size; };
+
+    for (auto i = 0u; i < rects.size(); i++) {
+        auto& other = rects[i];
+        auto x = std::min(rect.x, other.x), y = std::min(rect.y, other.y);
+        auto x_end = std::max(rect.x + rect.x_size, other.x + other.x_size);
+        auto y_end = std::max(rect.y + rect.y_size, other.y + other.y_size);
+        Rect box{x, y, x_end - x, y_end - y};
+
+        auto overlap = rect.x < other.x + other.x_size && other.x < rect.x + rect.x_size && rect.y < other.y + other.y_size && other.y < rect.y + rect.y_size;
+        if (overlap && area(box) <= area(rect) + area(other)) {
+            // the box may overlap others now, start over with it
+            rects.erase(rects.begin() + i);
+            add_rect(rects, box);
+            return;
+        }
+    }
+    rects.push_back(rect);
+}
+
+void convolve_update(const Matrix& m, Matrix& out, const std::vector<Rect>& changed, const std::vector<Stage>& stages, Pool& pool) {
+    const auto x_size = m.get_x_size();
+    const auto y_size = m.get_y_size();
+
+    if (out.get_x_size() != x_size || out.get_y_size() != y_size) {
+        throw std::runtime_error{"output is not the size of the image"};
+    }
+
+    // an output pixel reads input pixels up to the sum of the radii away
+    std::vector<Rect> dirty;
+    for (auto& rect : changed) {
+        if (rect.x >= x_size || rect.y >= y_size || rect.x_size == 0 || rect.y_size == 0) {
+            continue;
+        }
+        add_rect(dirty, get_reach(rect, stages, x_size, y_size));
+    }
+
+    for (auto& rect : dirty) {
+        out.paste(convolve(MatrixView{m, rect.x, rect.y, rect.x_size, rect.y_size}, stages, pool), rect.x, rect.y);
+    }
+}
+
+void blur_update(const Matrix& m, Matrix& blurred, const std::vector<Rect>& changed, const int radius, Pool& pool) {
+    auto kernel = Gauss::get_kernel(radius);
+    convolve_update(m, blurred, changed, {Stage{kernel, kernel}}, pool);
+}
+
+void convolve_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const std::vector<Stage>& stages) {
+    const auto x_size = reader.get_header().x_size;
+    const auto y_size = reader.get_header().y_size;
+
+    // one input row and one output row, r, g and b planes one after the other
+    std::vector<unsigned char> in(3ul * x_size), out(3ul * x_size);
+    unsigned char* const outs[]{out.data(), out.data() + x_size, out.data() + 2ul * x_size};
+
+    // the first stage asks for every row once and in order, which is how reader gives them
+    auto read = [&](unsigned, const unsigned char* rows[3]) {
+        reader(in.data(), in.data() + x_size, in.data() + 2ul * x_size);
+        for (auto c = 0; c < 3; c++) rows[c] = in.data() + c * static_cast<size_t>(x_size);
+    };
+
+    if (stages.empty()) {
+        for (auto y = 0u; y < y_size; y++) {
+            const unsigned char* rows[3];
+            read(y, rows);
+            writer(rows[0], rows[1], rows[2]);
+        }
+        return;
+    }
+
+    Cascade cascade{stages, x_size, y_size, read, 0, x_size};
+
+    for (auto y = 0u; y < y_size; y++) {
+        cascade(y, outs);
+        writer(outs[0], outs[1], outs[2]);
+    }
+}
+
+void convolve_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const Kernel& horizontal, const Kernel& vertical) {
+    convolve_stream(reader, writer, {Stage{horizontal, vertical}});
+}
+
+void blur_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const int radius) {
+    auto kernel = Gauss::get_kernel(radius);
+    convolve_stream(reader, writer, kernel, kernel);
+}
+// Radius argument of a chain step, throws if it isn't a number from Gauss::min_radius
+// to Gauss::max_radius - 1
+int get_radius(const std::string& step, const std::string& arg) {
+    if (arg.empty() || arg.size() > 4 || arg.find_first_not_of("0123456789") != std::string::npos
+        || std::stoi(arg) < static_cast<int>(Gauss::min_radius) || std::stoi(arg) >= static_cast<int>(Gauss::max_radius)) {
+        throw std::runtime_error{"bad radius in " + step};
+    }
+    return std::stoi(arg);
+}
+
+std::vector<Stage> parse_chain(const std::string& spec) {
+    std::vector<Stage> stages;
+    std::istringstream steps{spec};
+
+    for (std::string step; std::getline(steps, step, ',');) {
+        auto colon = step.find(':');
+        auto name = step.substr(0, colon);
+        auto arg = colon == std::string::npos ? std::string{} : step.substr(colon + 1);
+
+        if (name == "blur") {
+            auto kernel = Gauss::get_kernel(get_radius(step, arg));
+            stages.push_back({kernel, kernel});
+        } else if (name == "box") {
+            auto radius = get_radius(step, arg);
+            Kernel kernel{radius, std::vector<double>(2 * radius + 1, 1), Edge::renormalize, 0};
+            stages.push_back({kernel, kernel});
+        } else if (name == "sobel" && (arg == "x" || arg == "y")) {
+            // halved so the derivative of 0 .. 255 fits around 128
+            Kernel derivative{1, {-0.5, 0, 0.5}, Edge::replicate, 128};
+            Kernel smooth{1, {1, 2, 1}, Edge::renormalize, 0};
+            stages.push_back(arg == "x" ? Stage{derivative, smooth} : Stage{smooth, derivative});
+        } else {
+            throw std::runtime_error{"unknown step " + step};
+        }
+    }
+
+    if (stages.empty()) {
+        throw std::runtime_error{"empty chain"};
+    }
+    return stages;
+}
+
+};
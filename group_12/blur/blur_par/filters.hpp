@@ -3,6 +3,10 @@ Author: David Holmqvist <daae19@student.bth.se>
 */
 
 #include "matrix.hpp"
+#include "pool.hpp"
+#include "ppm.hpp"
+#include <string>
+#include <vector>
 
 #if !defined(FILTERS_HPP)
 #define FILTERS_HPP
@@ -10,17 +14,191 @@ Author: David Holmqvist <daae19@student.bth.se>
 namespace Filter
 {
 
+    // How a 1-D kernel treats the taps that fall outside the image
+    enum class Edge {
+        // drops them and divides by the sum of the weights left, for kernels that sum
+        // to 1 like the blurs
+        renormalize,
+        // reads the nearest edge pixel instead, for kernels that don't sum to 1 like
+        // derivatives and sharpening
+        replicate,
+    };
+
+    // A 1-D kernel for convolve, weights[radius + k] weighs the sample k steps away
+    struct Kernel {
+        int radius;
+        std::vector<double> weights;
+        Edge edge;
+        // added to every result before it is clamped to 0 .. 255, 128 keeps the negative
+        // half of a derivative
+        double offset;
+    };
+
+    // One separable step of a chain, filtering the rows with horizontal and then the
+    // columns with vertical
+    struct Stage {
+        Kernel horizontal;
+        Kernel vertical;
+    };
+
     namespace Gauss
     {
         constexpr unsigned max_radius{1000};
+        // get_weights spreads max_x over the radius, at 0 it divides by zero
+        constexpr unsigned min_radius{1};
         constexpr float max_x{1.33};
         constexpr float pi{3.14159};
 
         void get_weights(int n, double *weights_out);
+
+        // The weights of get_weights mirrored into a Kernel with renormalized edges
+        Kernel get_kernel(int n);
+
+        // Standard deviation of the Gaussian that get_weights samples for radius n
+        double sigma(int n);
+
+        // Young-van Vliet recursive filter coefficients for sigma, written as
+        // { B, b1 / b0, b2 / b0, b3 / b0 }. Valid for sigma >= 0.5.
+        void get_recursive_coefficients(double sigma, double *coefficients_out);
+
+        // Below this radius sigma drops under 0.5 and the recursive filter is not valid
+        constexpr int min_recursive_radius{2};
+
+        // Number of box blurs that approximate one Gaussian in Mode::box
+        constexpr int box_passes{3};
+
+        // Below this radius the boxes collapse to widths 1 and 3, which approximate the
+        // Gaussian badly, and the direct kernel is only a few taps anyway
+        constexpr int min_box_radius{5};
+
+        // Radii of the box_passes boxes whose combined variance best matches sigma
+        void get_box_radii(double sigma, int *radii_out);
     }
+
+    // Engine used by blur, all engines take the same radius
+    enum class Mode {
+        // direct convolution with the weights from Gauss::get_weights, O(radius) per pixel
+        gauss,
+        // recursive (IIR) Gaussian, O(1) per pixel whatever the radius. Edges are
+        // extended by replicating the border pixel instead of renormalizing the kernel.
+        iir,
+        // Gauss::box_passes running sum box blurs, O(1) per pixel, preview quality.
+        // Edges are renormalized over the samples inside the image like gauss.
+        box,
+        // gauss with Q15 integer weights and 16 bit AVX2 arithmetic. Stays within
+        // 2 of gauss on every channel, see verify_fixed.sh.
+        fixed,
+        // gauss in single precision, 8 lanes to an AVX2 vector instead of 4. Stays
+        // within 2 of gauss on every channel for the same reason as fixed, see verify.sh.
+        float32,
+    };
+
+    // How blur splits the work between threads
+    enum class Schedule {
+        // each thread blurs its band of rows horizontally into scratch, and after all of
+        // them are done each blurs its band vertically
+        passes,
+        // each thread runs both passes over its band on its own, keeping only the
+        // 2 * radius + 1 rows the vertical pass needs. There is no wait between the passes
+        // and no scratch, but the radius rows on each side of a band are blurred
+        // horizontally twice, so bands should be tall compared to the radius. Only
+        // Mode::gauss has it, the other modes always run in passes.
+        pipelined,
+        // passes split into small bands that threads take from their own queue and
+        // steal from others once it is empty, so a slow or descheduled thread holds
+        // up the pass by one band instead of its whole slice
+        stealing,
+    };
+
     // Thread data structure for passing parameters to threads, for passing the data to each thread
    
-    Matrix blur(Matrix m, const int radius, const int threadscount);
+    Matrix blur(const Matrix& m, const int radius, const int threadscount, Mode mode = Mode::gauss, Schedule schedule = Schedule::passes);
+    // Same as above but keeps the intermediate image in scratch, which is resized to
+    // the input and can be passed again to skip the allocation on later calls
+    Matrix blur(const Matrix& m, const int radius, const int threadscount, Matrix& scratch, Mode mode = Mode::gauss, Schedule schedule = Schedule::passes);
+    // Same as above but runs on the threads of pool, which stay parked between calls
+    Matrix blur(const Matrix& m, const int radius, Pool& pool, Matrix& scratch, Mode mode = Mode::gauss, Schedule schedule = Schedule::passes);
+
+    // Filters the rows of m with horizontal and then the columns with vertical, each
+    // pass truncating to 8 bits. This is the engine behind Mode::gauss and runs on the
+    // same vectorized passes, schedules and edge handling, blur(m, r, ...) in that mode
+    // is convolve(m, Gauss::get_kernel(r), Gauss::get_kernel(r), ...).
+    Matrix convolve(const Matrix& m, const Kernel& horizontal, const Kernel& vertical, Pool& pool, Matrix& scratch, Schedule schedule = Schedule::passes);
+
+    // Runs the stages one after the other as if convolve was called for each, but in one
+    // traversal of the image: each thread takes a band of rows and pushes it through all
+    // stages a row at a time, so the images between stages stay in cache and are never
+    // allocated. Output matches the convolve calls. Schedule::pipelined is this with
+    // one stage.
+    Matrix convolve(const Matrix& m, const std::vector<Stage>& stages, Pool& pool);
+
+    // The region view covers of convolve(view.get_parent(), stages, pool), with the
+    // pixels around the region read from the parent as far as the stages reach. Only the
+    // region and that margin are filtered, so the cost grows with the area of the region
+    // rather than of the parent. Packed parents are converted to planar whole first.
+    Matrix convolve(const MatrixView& view, const std::vector<Stage>& stages, Pool& pool);
+
+    // blur of the region view covers in Mode::gauss, the same way
+    Matrix blur(const MatrixView& view, const int radius, Pool& pool);
+
+    // How the outputs of a stack relate to each other
+    enum class Stack {
+        // every output filters the input, as if convolve was called once for each stage
+        separate,
+        // every output filters the one before it, as if convolve was called with the
+        // stages up to it
+        cascaded,
+    };
+
+    // The input filtered by each of the stages in one traversal of m: each thread takes
+    // a band of rows and, in separate, filters every input row by all stages while it
+    // is in cache, or in cascaded runs the band through the stages as a chain that
+    // keeps the output of every stage. Output k matches convolve(m, {stages[k]}, pool) or
+    // convolve(m, stages up to k, pool).
+    std::vector<Matrix> convolve_stack(const Matrix& m, const std::vector<Stage>& stages, Pool& pool, Stack stack = Stack::separate);
+
+    // convolve_stack with the Mode::gauss kernel of each of radii, in cascaded radii are
+    // the steps between outputs rather than the radii of the outputs
+    std::vector<Matrix> blur_stack(const Matrix& m, const std::vector<int>& radii, Pool& pool, Stack stack = Stack::separate);
+
+    // A rectangle of an image, x_size * y_size pixels from x, y on
+    struct Rect {
+        unsigned x, y;
+        unsigned x_size, y_size;
+    };
+
+    // Brings out, the output of convolve(before, stages, ...), up to date with m after
+    // the pixels in changed were edited. Only the output pixels within reach of a
+    // change are filtered again, the rectangles widened by the radii of the stages and
+    // merged where they overlap, so the cost grows with the edited area rather than
+    // with the image. Output matches convolve(m, stages, pool). Parts of rectangles
+    // outside the image are ignored, throws std::runtime_error when out is not the size
+    // of m.
+    void convolve_update(const Matrix& m, Matrix& out, const std::vector<Rect>& changed, const std::vector<Stage>& stages, Pool& pool);
+
+    // convolve_update for an output of blur in Mode::gauss
+    void blur_update(const Matrix& m, Matrix& blurred, const std::vector<Rect>& changed, const int radius, Pool& pool);
+
+    // Parses a chain spec, comma separated steps out of
+    //   blur:R   Gauss::get_kernel(R) both ways, what Mode::gauss does
+    //   box:R    box of radius R both ways, edges renormalized
+    //   sobel:x  horizontal derivative smoothed vertically, 128 is flat
+    //   sobel:y  the same turned around
+    // such as "blur:15,blur:3", with R from Gauss::min_radius to Gauss::max_radius - 1.
+    // Throws std::runtime_error on a bad spec.
+    std::vector<Stage> parse_chain(const std::string& spec);
+
+    // The stages of convolve from reader to writer a row at a time, the same way
+    void convolve_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const std::vector<Stage>& stages);
+
+    // convolve from reader to writer a row at a time, for images too big to hold in
+    // memory. Keeps 2 * vertical.radius + 1 filtered rows, so memory grows with width
+    // times radius but not with height. Output matches convolve. Throws what reader and
+    // writer throw.
+    void convolve_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const Kernel& horizontal, const Kernel& vertical);
+
+    // convolve_stream with the Mode::gauss kernel
+    void blur_stream(PPM::Row_Reader& reader, PPM::Row_Writer& writer, const int radius);
 
 };
 
@@ -0,0 +1,125 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "fixed.hpp"
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+namespace Filter::Fixed
+{
+    Table::Table(const double* w, int radius, unsigned size)
+        : radius{radius}
+        , offsets(size)
+    {
+        // the interior table goes first, border positions append their own
+        add(w, radius, radius);
+
+        for (auto p{0u}; p < size; p++)
+        {
+            auto before{std::min<int>(radius, p)};
+            auto after{std::min<int>(radius, size - 1 - p)};
+
+            if (before == radius && after == radius)
+            {
+                offsets[p] = 0;
+                continue;
+            }
+
+            offsets[p] = weights.size();
+            add(w, before, after);
+        }
+    }
+
+    void Table::add(const double* w, int before, int after)
+    {
+        auto start{weights.size()};
+        weights.resize(start + taps(), 0);
+        auto table{weights.data() + start};
+
+        double n{0};
+        for (auto k{-before}; k <= after; k++)
+        {
+            n += w[std::abs(k)];
+        }
+
+        int sum{0};
+        for (auto k{-before}; k <= after; k++)
+        {
+            table[k + radius] = static_cast<int16_t>(std::lround(w[std::abs(k)] / n * (1 << shift)));
+            sum += table[k + radius];
+        }
+
+        // rounding can leave the table a few units off, the center tap absorbs that
+        table[radius] += (1 << shift) - sum;
+    }
+
+    unsigned Table::taps() const
+    {
+        return (2 * radius + 2) & ~1u;
+    }
+
+    const int16_t* Table::at(unsigned position) const
+    {
+        return weights.data() + offsets[position];
+    }
+
+    namespace
+    {
+        void convolve_scalar(const unsigned char* const* taps, const int16_t* weights, unsigned tap_count, unsigned char* out, unsigned count, unsigned start)
+        {
+            for (auto i{start}; i < count; i++)
+            {
+                int32_t acc{0};
+                for (auto j{0u}; j < tap_count; j++)
+                {
+                    acc += weights[j] * taps[j][i];
+                }
+                out[i] = acc >> shift;
+            }
+        }
+
+        __attribute__((target("avx2"))) void convolve_avx2(const unsigned char* const* taps, const int16_t* weights, unsigned tap_count, unsigned char* out, unsigned count)
+        {
+            auto i{0u};
+
+            for (; i + 16 <= count; i += 16)
+            {
+                auto acc_lo{_mm256_setzero_si256()}, acc_hi{_mm256_setzero_si256()};
+
+                for (auto j{0u}; j < tap_count; j += 2)
+                {
+                    // 16 pixels of two taps widened to 16 bits, interleaved into pairs so
+                    // one vpmaddwd does both multiplies and the add for 8 pixels
+                    auto a{_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[j] + i)))};
+                    auto b{_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[j + 1] + i)))};
+                    auto w{_mm256_set1_epi32(static_cast<uint16_t>(weights[j]) | static_cast<uint32_t>(weights[j + 1]) << 16)};
+
+                    acc_lo = _mm256_add_epi32(acc_lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+                    acc_hi = _mm256_add_epi32(acc_hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+                }
+
+                // unpacklo/hi split each lane in halves, packing them back restores the order
+                auto words{_mm256_packs_epi32(_mm256_srli_epi32(acc_lo, shift), _mm256_srli_epi32(acc_hi, shift))};
+                auto bytes{_mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08)};
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(bytes));
+            }
+
+            convolve_scalar(taps, weights, tap_count, out, count, i);
+        }
+
+        void convolve_generic(const unsigned char* const* taps, const int16_t* weights, unsigned tap_count, unsigned char* out, unsigned count)
+        {
+            convolve_scalar(taps, weights, tap_count, out, count, 0);
+        }
+    }
+
+    void convolve(const unsigned char* const* taps, const int16_t* weights, unsigned tap_count, unsigned char* out, unsigned count)
+    {
+        static const auto kernel{__builtin_cpu_supports("avx2") ? convolve_avx2 : convolve_generic};
+
+        kernel(taps, weights, tap_count, out, count);
+    }
+}
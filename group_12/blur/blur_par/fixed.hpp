@@ -0,0 +1,45 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include <cstdint>
+#include <vector>
+
+#if !defined(FIXED_HPP)
+#define FIXED_HPP
+
+namespace Filter::Fixed
+{
+    // Weights are Q15, every table sums to exactly 1 << shift
+    constexpr int shift{15};
+
+    // Q15 Gaussian weights for every position along a line of size samples. Positions
+    // closer than radius to an edge get their own table, normalized over the taps that
+    // fall inside the line like the double kernel does, the interior shares one table.
+    // Each table holds taps() weights for the offsets -radius .. radius, padded with a
+    // zero weight to an even count so the SIMD kernel can consume them in pairs.
+    // size must be at least 2, a line of one sample has a lone tap of weight 1, which
+    // Q15 can't hold in an int16_t.
+    class Table
+    {
+    private:
+        int radius;
+        std::vector<int16_t> weights;
+        std::vector<unsigned> offsets;
+
+        void add(const double* w, int before, int after);
+
+    public:
+        // w holds the radius + 1 weights from Gauss::get_weights
+        Table(const double* w, int radius, unsigned size);
+
+        unsigned taps() const;
+        const int16_t* at(unsigned position) const;
+    };
+
+    // out[i] = (sum of weights[j] * taps[j][i] over j) >> shift for i < count, where
+    // tap_count is even. Uses AVX2 for 16 outputs at a time when the CPU has it.
+    void convolve(const unsigned char* const* taps, const int16_t* weights, unsigned tap_count, unsigned char* out, unsigned count);
+}
+
+#endif
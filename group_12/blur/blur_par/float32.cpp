@@ -0,0 +1,124 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "float32.hpp"
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+namespace Filter::Float32
+{
+    Table::Table(const double* w, int radius, unsigned size)
+        : radius{radius}
+        , offsets(size)
+    {
+        // the interior table goes first, border positions append their own
+        add(w, radius, radius);
+
+        for (auto p{0u}; p < size; p++)
+        {
+            auto before{std::min<int>(radius, p)};
+            auto after{std::min<int>(radius, size - 1 - p)};
+
+            if (before == radius && after == radius)
+            {
+                offsets[p] = 0;
+                continue;
+            }
+
+            offsets[p] = weights.size();
+            add(w, before, after);
+        }
+    }
+
+    void Table::add(const double* w, int before, int after)
+    {
+        auto start{weights.size()};
+        weights.resize(start + taps(), 0);
+        auto table{weights.data() + start};
+
+        double n{0};
+        for (auto k{-before}; k <= after; k++)
+        {
+            n += w[std::abs(k)];
+        }
+
+        for (auto k{-before}; k <= after; k++)
+        {
+            table[k + radius] = static_cast<float>(w[std::abs(k)] / n);
+        }
+    }
+
+    unsigned Table::taps() const
+    {
+        return 2 * radius + 1;
+    }
+
+    const float* Table::at(unsigned position) const
+    {
+        return weights.data() + offsets[position];
+    }
+
+    namespace
+    {
+        void convolve_scalar(const unsigned char* const* taps, const float* weights, unsigned tap_count, unsigned char* out, unsigned count, unsigned start)
+        {
+            for (auto i{start}; i < count; i++)
+            {
+                float acc{0};
+                for (auto j{0u}; j < tap_count; j++)
+                {
+                    acc += weights[j] * taps[j][i];
+                }
+                out[i] = std::min(std::max(acc, 0.0f), 255.0f);
+            }
+        }
+
+        __attribute__((target("avx2,fma"))) void convolve_avx2(const unsigned char* const* taps, const float* weights, unsigned tap_count, unsigned char* out, unsigned count)
+        {
+            auto i{0u};
+            auto low{_mm256_setzero_ps()}, high{_mm256_set1_ps(255)};
+
+            for (; i + 16 <= count; i += 16)
+            {
+                auto acc_lo{_mm256_setzero_ps()}, acc_hi{_mm256_setzero_ps()};
+
+                for (auto j{0u}; j < tap_count; j++)
+                {
+                    // 16 pixels of one tap widened to two vectors of 8 floats
+                    auto bytes{_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[j] + i))};
+                    auto a{_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes))};
+                    auto b{_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)))};
+                    auto w{_mm256_set1_ps(weights[j])};
+
+                    acc_lo = _mm256_fmadd_ps(a, w, acc_lo);
+                    acc_hi = _mm256_fmadd_ps(b, w, acc_hi);
+                }
+
+                auto lo{_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc_lo, low), high))};
+                auto hi{_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc_hi, low), high))};
+
+                // the packs work within 128 bit lanes, the permutes put the pixels back in order
+                auto words{_mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8)};
+                auto packed{_mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08)};
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_castsi256_si128(packed));
+            }
+
+            convolve_scalar(taps, weights, tap_count, out, count, i);
+        }
+
+        void convolve_generic(const unsigned char* const* taps, const float* weights, unsigned tap_count, unsigned char* out, unsigned count)
+        {
+            convolve_scalar(taps, weights, tap_count, out, count, 0);
+        }
+    }
+
+    void convolve(const unsigned char* const* taps, const float* weights, unsigned tap_count, unsigned char* out, unsigned count)
+    {
+        static const auto kernel{__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? convolve_avx2 : convolve_generic};
+
+        kernel(taps, weights, tap_count, out, count);
+    }
+}
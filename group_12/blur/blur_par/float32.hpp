@@ -0,0 +1,40 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include <vector>
+
+#if !defined(FLOAT32_HPP)
+#define FLOAT32_HPP
+
+namespace Filter::Float32
+{
+    // Single precision Gaussian weights for every position along a line of size samples,
+    // already divided by their sum so the kernel needs no division. Positions closer than
+    // radius to an edge get their own table with zero weights for the taps outside the
+    // line, the interior shares one table. Each table holds taps() weights for the offsets
+    // -radius .. radius.
+    class Table
+    {
+    private:
+        int radius;
+        std::vector<float> weights;
+        std::vector<unsigned> offsets;
+
+        void add(const double* w, int before, int after);
+
+    public:
+        // w holds the radius + 1 weights from Gauss::get_weights
+        Table(const double* w, int radius, unsigned size);
+
+        unsigned taps() const;
+        const float* at(unsigned position) const;
+    };
+
+    // out[i] = sum of weights[j] * taps[j][i] over j, clamped to 0 .. 255 and truncated,
+    // for i < count. Uses AVX2 and FMA for 16 outputs at a time, 8 to a vector, when the
+    // CPU has them.
+    void convolve(const unsigned char* const* taps, const float* weights, unsigned tap_count, unsigned char* out, unsigned count);
+}
+
+#endif
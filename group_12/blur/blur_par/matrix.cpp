@@ -4,107 +4,338 @@ Author: David Holmqvist <daae19@student.bth.se>
 
 #include "matrix.hpp"
 #include "ppm.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <new>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <utility>
+
+namespace {
+
+// A huge page on x86-64, smaller storage gains nothing from them
+constexpr size_t huge_page { 2ul << 20 };
+
+Matrix::Pages pages { Matrix::Pages::normal };
+
+unsigned get_stride(unsigned x_size, Matrix::Layout layout)
+{
+    auto bytes { layout == Matrix::Layout::packed ? 4 * x_size : x_size };
+    auto stride { (bytes + Matrix::alignment - 1) / Matrix::alignment * Matrix::alignment };
+
+    // rows a multiple of 4 KiB apart land in the same cache sets, which the vertical
+    // pass reading down a column would thrash
+    if (stride > 0 && stride % 4096 == 0) {
+        stride += Matrix::alignment;
+    }
+    return stride;
+}
+
+size_t get_storage_size(unsigned x_size, unsigned y_size, Matrix::Layout layout)
+{
+    auto planes { layout == Matrix::Layout::packed ? 1ul : 3ul };
+    return planes * get_stride(x_size, layout) * y_size;
+}
+
+// size bytes aligned to Matrix::alignment or more, size grows to what was mapped when
+// mapped is set
+unsigned char* allocate(size_t& size, bool& mapped)
+{
+    mapped = false;
+
+    if (size == 0) {
+        return nullptr;
+    }
+
+    if (pages != Matrix::Pages::normal && size >= huge_page) {
+        size = (size + huge_page - 1) / huge_page * huge_page;
+
+        if (pages == Matrix::Pages::hugetlb) {
+            auto p { mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) };
+            if (p != MAP_FAILED) {
+                mapped = true;
+                return static_cast<unsigned char*>(p);
+            }
+        }
+
+        // map a huge page more than needed and trim both ends so the storage starts on
+        // a huge page boundary, otherwise its first and last huge page can't be used
+        auto p { mmap(nullptr, size + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) };
+        if (p != MAP_FAILED) {
+            auto start { reinterpret_cast<uintptr_t>(p) };
+            auto aligned { (start + huge_page - 1) / huge_page * huge_page };
+
+            if (aligned > start) {
+                munmap(p, aligned - start);
+            }
+            munmap(reinterpret_cast<void*>(aligned + size), start + huge_page - aligned);
+            madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+
+            mapped = true;
+            return reinterpret_cast<unsigned char*>(aligned);
+        }
+    }
+
+    auto p { std::aligned_alloc(Matrix::alignment, (size + Matrix::alignment - 1) / Matrix::alignment * Matrix::alignment) };
+
+    if (!p) {
+        throw std::bad_alloc {};
+    }
+    return static_cast<unsigned char*>(p);
+}
+
+void release(unsigned char* storage, size_t size, bool mapped)
+{
+    if (mapped) {
+        munmap(storage, size);
+    } else {
+        std::free(storage);
+    }
+}
+
+}
+
+void Matrix::set_pages(Pages pages)
+{
+    ::pages = pages;
+}
 
 Matrix::Matrix(unsigned char* R, unsigned char* G, unsigned char* B, unsigned x_size, unsigned y_size, unsigned color_max)
-    : R { R }
-    , G { G }
-    , B { B }
-    , x_size { x_size }
-    , y_size { y_size }
-    , color_max { color_max }
+    : Matrix { x_size, y_size, color_max }
 {
+    for (auto y { 0u }; y < y_size; y++) {
+        std::memcpy(this->R + y * stride, R + y * x_size, x_size);
+        std::memcpy(this->G + y * stride, G + y * x_size, x_size);
+        std::memcpy(this->B + y * stride, B + y * x_size, x_size);
+    }
+
+    delete[] R;
+    delete[] G;
+    delete[] B;
 }
 
-Matrix::Matrix()
-    : Matrix {
-        nullptr,
-        nullptr,
-        nullptr,
-        0,
-        0,
-        0,
+Matrix::Matrix(const MatrixView& view)
+    : Matrix { view, view.get_parent().get_layout() }
+{
+}
+
+Matrix::Matrix(const MatrixView& view, Layout layout)
+    : Matrix { view.get_x_size(), view.get_y_size(), view.get_parent().get_color_max(), layout }
+{
+    auto& parent { view.get_parent() };
+
+    if (layout == parent.get_layout()) {
+        auto bytes { layout == Layout::packed ? 4 * x_size : x_size };
+
+        for (auto y { 0u }; y < y_size; y++) {
+            auto from { static_cast<size_t>(y) * view.get_stride() };
+            if (layout == Layout::packed) {
+                std::memcpy(pixels + y * stride, view.get_pixels() + from, bytes);
+            } else {
+                std::memcpy(R + y * stride, view.get_R() + from, bytes);
+                std::memcpy(G + y * stride, view.get_G() + from, bytes);
+                std::memcpy(B + y * stride, view.get_B() + from, bytes);
+            }
+        }
+        return;
     }
+
+    for (auto y { 0u }; y < y_size; y++) {
+        for (auto x { 0u }; x < x_size; x++) {
+            auto from_x { view.get_x() + x }, from_y { view.get_y() + y };
+            if (layout == Layout::packed) {
+                auto pixel { pixels + y * stride + 4 * x };
+                pixel[0] = parent.r(from_x, from_y);
+                pixel[1] = parent.g(from_x, from_y);
+                pixel[2] = parent.b(from_x, from_y);
+                pixel[3] = 0;
+            } else {
+                r(x, y) = parent.r(from_x, from_y);
+                g(x, y) = parent.g(from_x, from_y);
+                b(x, y) = parent.b(from_x, from_y);
+            }
+        }
+    }
+}
+
+Matrix::Matrix()
+    : storage { nullptr }
+    , storage_size { 0 }
+    , mapped { false }
+    , R { nullptr }
+    , G { nullptr }
+    , B { nullptr }
+    , pixels { nullptr }
+    , layout { Layout::planar }
+    , x_size { 0 }
+    , y_size { 0 }
+    , color_max { 0 }
+    , stride { 0 }
 {
 }
 
 Matrix::Matrix(unsigned dimension)
-    : R { new unsigned char[dimension * dimension] }
-    , G { new unsigned char[dimension * dimension] }
-    , B { new unsigned char[dimension * dimension] }
-    , x_size { dimension }
-    , y_size { dimension }
-    , color_max { 0 }
+    : Matrix { dimension, dimension, 0 }
+{
+}
+
+Matrix::Matrix(unsigned x_size, unsigned y_size, unsigned color_max, Layout layout)
+    : storage { nullptr }
+    , storage_size { get_storage_size(x_size, y_size, layout) }
+    , mapped { false }
+    , R { nullptr }
+    , G { nullptr }
+    , B { nullptr }
+    , pixels { nullptr }
+    , layout { layout }
+    , x_size { x_size }
+    , y_size { y_size }
+    , color_max { color_max }
+    , stride { ::get_stride(x_size, layout) }
 {
+    storage = allocate(storage_size, mapped);
+    place();
 }
 
 Matrix::Matrix(const Matrix& other)
-    : R { new unsigned char[other.x_size * other.y_size] }
-    , G { new unsigned char[other.x_size * other.y_size] }
-    , B { new unsigned char[other.x_size * other.y_size] }
-    , x_size { other.x_size }
-    , y_size { other.y_size }
-    , color_max { other.color_max }
-{
-    for (auto x { 0 }; x < x_size; x++) {
-        for (auto y { 0 }; y < y_size; y++) {
-            auto &r_val { r(x, y) }, &g_val { g(x, y) }, &b_val { b(x, y) };
-            auto other_r_val { other.r(x, y) }, other_g_val { other.g(x, y) }, other_b_val { other.b(x, y) };
-
-            r_val = other_r_val;
-            g_val = other_g_val;
-            b_val = other_b_val;
-        }
+    : Matrix { other.x_size, other.y_size, other.color_max, other.layout }
+{
+    // same width and layout, so the same stride and the planes at the same offsets
+    auto size { get_storage_size(x_size, y_size, layout) };
+
+    if (size > 0) {
+        std::memcpy(storage, other.storage, size);
     }
 }
 
-Matrix& Matrix::operator=(const Matrix other)
+Matrix::Matrix(const Matrix& other, Layout layout)
+    : Matrix { other.x_size, other.y_size, other.color_max, layout }
 {
-    if (this == &other) {
-        return *this;
+    if (layout == other.layout) {
+        // same width and layout, so the same stride, copy into the storage just allocated
+        auto size { get_storage_size(x_size, y_size, layout) };
+
+        if (size > 0) {
+            std::memcpy(storage, other.storage, size);
+        }
+        return;
     }
 
-    this->~Matrix();
+    for (auto y { 0u }; y < y_size; y++) {
+        for (auto x { 0u }; x < x_size; x++) {
+            if (layout == Layout::packed) {
+                auto pixel { pixels + y * stride + 4 * x };
+                pixel[0] = other.r(x, y);
+                pixel[1] = other.g(x, y);
+                pixel[2] = other.b(x, y);
+                pixel[3] = 0;
+            } else {
+                r(x, y) = other.r(x, y);
+                g(x, y) = other.g(x, y);
+                b(x, y) = other.b(x, y);
+            }
+        }
+    }
+}
 
-    R = new unsigned char[other.x_size * other.y_size];
-    G = new unsigned char[other.x_size * other.y_size];
-    B = new unsigned char[other.x_size * other.y_size];
+Matrix::Matrix(Matrix&& other) noexcept
+    : Matrix {}
+{
+    *this = std::move(other);
+}
 
-    x_size = other.x_size;
-    y_size = other.y_size;
-    color_max = other.color_max;
+Matrix& Matrix::operator=(const Matrix& other)
+{
+    if (this != &other) {
+        *this = Matrix { other };
+    }
 
-    for (auto x { 0 }; x < x_size; x++) {
-        for (auto y { 0 }; y < y_size; y++) {
-            auto &r_val { r(x, y) }, &g_val { g(x, y) }, &b_val { b(x, y) };
-            auto other_r_val { other.r(x, y) }, other_g_val { other.g(x, y) }, other_b_val { other.b(x, y) };
+    return *this;
+}
 
-            r_val = other_r_val;
-            g_val = other_g_val;
-            b_val = other_b_val;
-        }
-    }
+Matrix& Matrix::operator=(Matrix&& other) noexcept
+{
+    // other's destructor releases whatever this owned before
+    std::swap(storage, other.storage);
+    std::swap(storage_size, other.storage_size);
+    std::swap(mapped, other.mapped);
+    std::swap(R, other.R);
+    std::swap(G, other.G);
+    std::swap(B, other.B);
+    std::swap(pixels, other.pixels);
+    std::swap(layout, other.layout);
+    std::swap(x_size, other.x_size);
+    std::swap(y_size, other.y_size);
+    std::swap(color_max, other.color_max);
+    std::swap(stride, other.stride);
 
     return *this;
 }
 
 Matrix::~Matrix()
 {
-    if (R) {
-        delete[] R;
-        R = nullptr;
+    if (storage) {
+        release(storage, storage_size, mapped);
+        storage = nullptr;
+    }
+
+    R = G = B = pixels = nullptr;
+    x_size = y_size = color_max = stride = 0;
+    storage_size = 0;
+}
+
+void Matrix::place()
+{
+    if (!storage) {
+        R = G = B = pixels = nullptr;
+    } else if (layout == Layout::packed) {
+        R = G = B = nullptr;
+        pixels = storage;
+    } else {
+        R = storage;
+        G = R + stride * y_size;
+        B = G + stride * y_size;
+        pixels = nullptr;
     }
-    if (G) {
-        delete[] G;
-        G = nullptr;
+}
+
+void Matrix::resize(unsigned x_size, unsigned y_size)
+{
+    if (get_storage_size(x_size, y_size, layout) > storage_size) {
+        *this = Matrix { x_size, y_size, color_max, layout };
+        return;
     }
-    if (B) {
-        delete[] B;
-        B = nullptr;
+
+    this->x_size = x_size;
+    this->y_size = y_size;
+    stride = ::get_stride(x_size, layout);
+    place();
+}
+
+void Matrix::paste(const Matrix& region, unsigned x, unsigned y)
+{
+    if (x > x_size || region.x_size > x_size - x || y > y_size || region.y_size > y_size - y) {
+        throw std::out_of_range { "region does not fit in the matrix" };
     }
 
-    x_size = y_size = color_max = 0;
+    for (auto row { 0u }; row < region.y_size; row++) {
+        if (layout != region.layout) {
+            for (auto column { 0u }; column < region.x_size; column++) {
+                r(x + column, y + row) = region.r(column, row);
+                g(x + column, y + row) = region.g(column, row);
+                b(x + column, y + row) = region.b(column, row);
+            }
+        } else if (layout == Layout::packed) {
+            std::memcpy(pixels + (y + row) * stride + 4 * x, region.pixels + row * region.stride, 4 * region.x_size);
+        } else {
+            auto to { (y + row) * stride + x }, from { row * region.stride };
+            std::memcpy(R + to, region.R + from, region.x_size);
+            std::memcpy(G + to, region.G + from, region.x_size);
+            std::memcpy(B + to, region.B + from, region.x_size);
+        }
+    }
 }
 
 unsigned Matrix::get_x_size() const
@@ -122,6 +353,16 @@ unsigned Matrix::get_color_max() const
     return color_max;
 }
 
+Matrix::Layout Matrix::get_layout() const
+{
+    return layout;
+}
+
+unsigned Matrix::get_stride() const
+{
+    return stride;
+}
+
 unsigned char const* Matrix::get_R() const
 {
     return R;
@@ -137,32 +378,108 @@ unsigned char const* Matrix::get_B() const
     return B;
 }
 
+unsigned char const* Matrix::get_pixels() const
+{
+    return pixels;
+}
+
 unsigned char Matrix::r(unsigned x, unsigned y) const
 {
-    return R[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x] : R[y * stride + x];
 }
 
 unsigned char Matrix::g(unsigned x, unsigned y) const
 {
-    return G[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x + 1] : G[y * stride + x];
 }
 
 unsigned char Matrix::b(unsigned x, unsigned y) const
 {
-    return B[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x + 2] : B[y * stride + x];
 }
 
 unsigned char& Matrix::r(unsigned x, unsigned y)
 {
-    return R[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x] : R[y * stride + x];
 }
 
 unsigned char& Matrix::g(unsigned x, unsigned y)
 {
-    return G[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x + 1] : G[y * stride + x];
 }
 
 unsigned char& Matrix::b(unsigned x, unsigned y)
 {
-    return B[y * x_size + x];
+    return layout == Layout::packed ? pixels[y * stride + 4 * x + 2] : B[y * stride + x];
+}
+
+MatrixView::MatrixView(const Matrix& parent, unsigned x, unsigned y, unsigned x_size, unsigned y_size)
+    : parent { &parent }
+    , x { x }
+    , y { y }
+    , x_size { x_size }
+    , y_size { y_size }
+{
+    if (x > parent.get_x_size() || x_size > parent.get_x_size() - x || y > parent.get_y_size() || y_size > parent.get_y_size() - y) {
+        throw std::out_of_range { "view does not fit in the matrix" };
+    }
+}
+
+MatrixView::MatrixView(const Matrix& parent)
+    : MatrixView { parent, 0, 0, parent.get_x_size(), parent.get_y_size() }
+{
+}
+
+const Matrix& MatrixView::get_parent() const
+{
+    return *parent;
+}
+
+unsigned MatrixView::get_x() const
+{
+    return x;
+}
+
+unsigned MatrixView::get_y() const
+{
+    return y;
+}
+
+unsigned MatrixView::get_x_size() const
+{
+    return x_size;
+}
+
+unsigned MatrixView::get_y_size() const
+{
+    return y_size;
+}
+
+unsigned MatrixView::get_stride() const
+{
+    return parent->get_stride();
+}
+
+unsigned char const* MatrixView::get_R() const
+{
+    auto R { parent->get_R() };
+    return R ? R + static_cast<size_t>(y) * get_stride() + x : nullptr;
+}
+
+unsigned char const* MatrixView::get_G() const
+{
+    auto G { parent->get_G() };
+    return G ? G + static_cast<size_t>(y) * get_stride() + x : nullptr;
+}
+
+unsigned char const* MatrixView::get_B() const
+{
+    auto B { parent->get_B() };
+    return B ? B + static_cast<size_t>(y) * get_stride() + x : nullptr;
+}
+
+unsigned char const* MatrixView::get_pixels() const
+{
+    auto pixels { parent->get_pixels() };
+    return pixels ? pixels + static_cast<size_t>(y) * get_stride() + 4 * x : nullptr;
 }
@@ -2,36 +2,103 @@
 Author: David Holmqvist <daae19@student.bth.se>
 */
 
+#include <cstddef>
 #include <iostream>
 
 #if !defined(MATRIX_HPP)
 #define MATRIX_HPP
 
+class MatrixView;
+
 class Matrix {
+public:
+    // planar keeps each channel in its own plane, packed keeps the channels of a pixel
+    // together as 4 bytes R, G, B and an unused X, so one 32 bit load brings in a pixel
+    enum class Layout {
+        planar,
+        packed,
+    };
+
+    // What backs the storage of matrices allocated from now on. With transparent,
+    // storage of a huge page or more is mapped on a huge page boundary and marked for
+    // transparent huge pages. hugetlb takes it from the reserved huge page pool instead
+    // and falls back to transparent when the pool is empty.
+    enum class Pages {
+        normal,
+        transparent,
+        hugetlb,
+    };
+
+    // The planes, the RGBX data and every row in them start on a multiple of this
+    static constexpr unsigned alignment { 64 };
+
+    static void set_pages(Pages pages);
+
 private:
+    // one allocation holds the three planes or the RGBX data
+    unsigned char* storage;
+    size_t storage_size;
+    // whether storage came from mmap rather than the heap
+    bool mapped;
+
     unsigned char* R;
     unsigned char* G;
     unsigned char* B;
+    // RGBX data of a packed matrix, the planes are null then
+    unsigned char* pixels;
+
+    Layout layout;
 
     unsigned x_size;
     unsigned y_size;
     unsigned color_max;
+    unsigned stride;
+
+    // Points the planes or the RGBX data into storage for the current size
+    void place();
 
 public:
     Matrix();
     Matrix(unsigned dimension);
+    Matrix(unsigned x_size, unsigned y_size, unsigned color_max, Layout layout = Layout::planar);
     Matrix(const Matrix& other);
+    // Copy of other in layout, X bytes are 0
+    Matrix(const Matrix& other, Layout layout);
+    Matrix(Matrix&& other) noexcept;
+    // Takes over R, G and B allocated with new[] and x_size pixels to a row, copying
+    // them into aligned storage
     Matrix(unsigned char* R, unsigned char* G, unsigned char* B, unsigned x_size, unsigned y_size, unsigned color_max);
-    Matrix& operator=(const Matrix other);
+    // Copy of the region view covers, in the layout of its parent
+    explicit Matrix(const MatrixView& view);
+    // Copy of the region view covers in layout, X bytes are 0
+    Matrix(const MatrixView& view, Layout layout);
+    Matrix& operator=(const Matrix& other);
+    Matrix& operator=(Matrix&& other) noexcept;
     ~Matrix();
 
+    // Reshapes to x_size * y_size in the same layout, only reallocating when the storage
+    // is too small. Pixel contents are unspecified afterwards.
+    void resize(unsigned x_size, unsigned y_size);
+
+    // Copies region over the pixels from x, y on, throws std::out_of_range when it
+    // doesn't fit
+    void paste(const Matrix& region, unsigned x, unsigned y);
+
     unsigned get_x_size() const;
     unsigned get_y_size() const;
     unsigned get_color_max() const;
+    Layout get_layout() const;
+    // Bytes from the start of one row of a plane, or of the RGBX data, to the next. A
+    // multiple of alignment and the same for every matrix of the same width and layout,
+    // so kernels can index a source and its destination with one stride.
+    unsigned get_stride() const;
 
     unsigned char const* get_R() const;
     unsigned char const* get_G() const;
     unsigned char const* get_B() const;
+    // y_size rows of x_size RGBX pixels for a packed matrix, null for a planar one where
+    // the three above are null instead
+    unsigned char const* get_pixels() const;
 
     unsigned char r(unsigned x, unsigned y) const;
     unsigned char g(unsigned x, unsigned y) const;
@@ -41,4 +108,40 @@ public:
     unsigned char& b(unsigned x, unsigned y);
 };
 
+// A rectangle of a Matrix that shares its pixels instead of copying them, so filters can
+// work on a region and read the pixels around it from the parent. The parent must
+// outlive the view and not be resized while it is in use.
+class MatrixView {
+private:
+    const Matrix* parent;
+
+    unsigned x;
+    unsigned y;
+    unsigned x_size;
+    unsigned y_size;
+
+public:
+    // The x_size * y_size pixels of parent from x, y on, throws std::out_of_range when
+    // they don't fit in it
+    MatrixView(const Matrix& parent, unsigned x, unsigned y, unsigned x_size, unsigned y_size);
+    // The whole of parent
+    MatrixView(const Matrix& parent);
+
+    const Matrix& get_parent() const;
+    // Origin of the view in the parent
+    unsigned get_x() const;
+    unsigned get_y() const;
+    unsigned get_x_size() const;
+    unsigned get_y_size() const;
+    // Matrix::get_stride of the parent, rows of the view are as far apart
+    unsigned get_stride() const;
+
+    // The channels, or the RGBX data, at the origin of the view. Null like those of the
+    // parent for the other layout.
+    unsigned char const* get_R() const;
+    unsigned char const* get_G() const;
+    unsigned char const* get_B() const;
+    unsigned char const* get_pixels() const;
+};
+
 #endif
\ No newline at end of file
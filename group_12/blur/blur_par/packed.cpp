@@ -0,0 +1,74 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "packed.hpp"
+#include <algorithm>
+#include <immintrin.h>
+
+namespace Filter::Packed
+{
+    namespace
+    {
+        void convolve_scalar(const unsigned char* const* taps, const double* weights, unsigned tap_count, double norm, double offset, unsigned char* out, unsigned count, unsigned start)
+        {
+            for (auto i{4 * start}; i < 4 * count; i++)
+            {
+                double acc{0};
+                for (auto j{0u}; j < tap_count; j++)
+                {
+                    acc += weights[j] * taps[j][i];
+                }
+                out[i] = std::min(std::max(acc / norm + offset, 0.0), 255.0);
+            }
+        }
+
+        // acc / n + add clamped to 0 .. 255 and truncated to 4 integers
+        __attribute__((target("avx2"))) __m128i finish(__m256d acc, __m256d n, __m256d add)
+        {
+            auto clamped{_mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_div_pd(acc, n), add), _mm256_setzero_pd()), _mm256_set1_pd(255))};
+            return _mm256_cvttpd_epi32(clamped);
+        }
+
+        __attribute__((target("avx2"))) void convolve_avx2(const unsigned char* const* taps, const double* weights, unsigned tap_count, double norm, double offset, unsigned char* out, unsigned count)
+        {
+            auto i{0u};
+            auto n{_mm256_set1_pd(norm)}, add{_mm256_set1_pd(offset)};
+
+            // one pixel to a vector, four of them so the adds of one pixel don't wait for
+            // each other
+            for (; i + 4 <= count; i += 4)
+            {
+                auto acc0{_mm256_setzero_pd()}, acc1{_mm256_setzero_pd()}, acc2{_mm256_setzero_pd()}, acc3{_mm256_setzero_pd()};
+
+                for (auto j{0u}; j < tap_count; j++)
+                {
+                    auto pixels{_mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[j] + 4 * i))};
+                    auto w{_mm256_set1_pd(weights[j])};
+
+                    acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(w, _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(pixels))));
+                    acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(w, _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(pixels, 4)))));
+                    acc2 = _mm256_add_pd(acc2, _mm256_mul_pd(w, _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(pixels, 8)))));
+                    acc3 = _mm256_add_pd(acc3, _mm256_mul_pd(w, _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(pixels, 12)))));
+                }
+
+                auto words{_mm_packus_epi16(_mm_packs_epi32(finish(acc0, n, add), finish(acc1, n, add)), _mm_packs_epi32(finish(acc2, n, add), finish(acc3, n, add)))};
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), words);
+            }
+
+            convolve_scalar(taps, weights, tap_count, norm, offset, out, count, i);
+        }
+
+        void convolve_generic(const unsigned char* const* taps, const double* weights, unsigned tap_count, double norm, double offset, unsigned char* out, unsigned count)
+        {
+            convolve_scalar(taps, weights, tap_count, norm, offset, out, count, 0);
+        }
+    }
+
+    void convolve(const unsigned char* const* taps, const double* weights, unsigned tap_count, double norm, double offset, unsigned char* out, unsigned count)
+    {
+        static const auto kernel{__builtin_cpu_supports("avx2") ? convolve_avx2 : convolve_generic};
+
+        kernel(taps, weights, tap_count, norm, offset, out, count);
+    }
+}
@@ -0,0 +1,18 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#if !defined(PACKED_HPP)
+#define PACKED_HPP
+
+namespace Filter::Packed
+{
+    // For the count RGBX pixels starting at out, each of the four channels of pixel i is
+    // (sum of weights[j] * channel of pixel i at taps[j] over j) / norm + offset, clamped
+    // to 0 .. 255 and truncated. Taps are added in the order given and without FMA, so
+    // the result matches the planar double kernel when they come in its order. Uses
+    // AVX2 for 4 pixels at a time when the CPU has it, one pixel to a vector of 4 doubles.
+    void convolve(const unsigned char* const* taps, const double* weights, unsigned tap_count, double norm, double offset, unsigned char* out, unsigned count);
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "pixels.hpp"
+#include <immintrin.h>
+
+namespace Pixels {
+
+namespace {
+
+    // Both SIMD kernels work on groups of 16 pixels (48 interleaved bytes). A group is
+    // read as three 16 byte blocks a, b and c, and every output register is the OR of
+    // one pshufb per input register. Mask entries of -1 zero the byte. The AVX2 kernels
+    // run the same masks on two groups at once, one per 128 bit lane, since vpshufb
+    // never crosses lanes.
+
+    void deinterleave_scalar(unsigned char const* src, unsigned char* R, unsigned char* G, unsigned char* B, size_t count)
+    {
+        for (size_t i { 0 }; i < count; i++, src += 3) {
+            R[i] = src[0];
+            G[i] = src[1];
+            B[i] = src[2];
+        }
+    }
+
+    void interleave_scalar(unsigned char const* R, unsigned char const* G, unsigned char const* B, unsigned char* dst, size_t count)
+    {
+        for (size_t i { 0 }; i < count; i++, dst += 3) {
+            dst[0] = R[i];
+            dst[1] = G[i];
+            dst[2] = B[i];
+        }
+    }
+
+    __attribute__((target("ssse3"))) void deinterleave_ssse3(unsigned char const* src, unsigned char* R, unsigned char* G, unsigned char* B, size_t count)
+    {
+        auto const r0 { _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const r1 { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1) };
+        auto const r2 { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13) };
+        auto const g0 { _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const g1 { _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1) };
+        auto const g2 { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14) };
+        auto const b0 { _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const b1 { _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1) };
+        auto const b2 { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) };
+
+        size_t i { 0 };
+
+        for (; i + 16 <= count; i += 16, src += 48) {
+            auto a { _mm_loadu_si128(reinterpret_cast<__m128i const*>(src)) };
+            auto b { _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + 16)) };
+            auto c { _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + 32)) };
+
+            auto r { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)), _mm_shuffle_epi8(c, r2)) };
+            auto g { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)), _mm_shuffle_epi8(c, g2)) };
+            auto bl { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)), _mm_shuffle_epi8(c, b2)) };
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(R + i), r);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(G + i), g);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(B + i), bl);
+        }
+
+        deinterleave_scalar(src, R + i, G + i, B + i, count - i);
+    }
+
+    __attribute__((target("ssse3"))) void interleave_ssse3(unsigned char const* R, unsigned char const* G, unsigned char const* B, unsigned char* dst, size_t count)
+    {
+        auto const r0 { _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5) };
+        auto const g0 { _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1) };
+        auto const b0 { _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1) };
+        auto const r1 { _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1) };
+        auto const g1 { _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10) };
+        auto const b1 { _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1) };
+        auto const r2 { _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1) };
+        auto const g2 { _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1) };
+        auto const b2 { _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15) };
+
+        size_t i { 0 };
+
+        for (; i + 16 <= count; i += 16, dst += 48) {
+            auto r { _mm_loadu_si128(reinterpret_cast<__m128i const*>(R + i)) };
+            auto g { _mm_loadu_si128(reinterpret_cast<__m128i const*>(G + i)) };
+            auto b { _mm_loadu_si128(reinterpret_cast<__m128i const*>(B + i)) };
+
+            auto a { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0)) };
+            auto m { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1)) };
+            auto c { _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2)) };
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16), m);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+        }
+
+        interleave_scalar(R + i, G + i, B + i, dst, count - i);
+    }
+
+    // Loads the 16 byte blocks at lo and hi into the low and high lane of one register
+    __attribute__((target("avx2"))) inline __m256i load_lanes(unsigned char const* lo, unsigned char const* hi)
+    {
+        auto low { _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(lo))) };
+        return _mm256_inserti128_si256(low, _mm_loadu_si128(reinterpret_cast<__m128i const*>(hi)), 1);
+    }
+
+    // Stores the low and high lane of v to lo and hi
+    __attribute__((target("avx2"))) inline void store_lanes(unsigned char* lo, unsigned char* hi, __m256i v)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lo), _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hi), _mm256_extracti128_si256(v, 1));
+    }
+
+    __attribute__((target("avx2"))) void deinterleave_avx2(unsigned char const* src, unsigned char* R, unsigned char* G, unsigned char* B, size_t count)
+    {
+        auto const r0 { _mm256_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const r1 { _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1) };
+        auto const r2 { _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13) };
+        auto const g0 { _mm256_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const g1 { _mm256_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1) };
+        auto const g2 { _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14) };
+        auto const b0 { _mm256_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+        auto const b1 { _mm256_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1) };
+        auto const b2 { _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15) };
+
+        size_t i { 0 };
+
+        for (; i + 32 <= count; i += 32, src += 96) {
+            auto a { load_lanes(src, src + 48) };
+            auto b { load_lanes(src + 16, src + 64) };
+            auto c { load_lanes(src + 32, src + 80) };
+
+            auto r { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, r0), _mm256_shuffle_epi8(b, r1)), _mm256_shuffle_epi8(c, r2)) };
+            auto g { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, g0), _mm256_shuffle_epi8(b, g1)), _mm256_shuffle_epi8(c, g2)) };
+            auto bl { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, b0), _mm256_shuffle_epi8(b, b1)), _mm256_shuffle_epi8(c, b2)) };
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(R + i), r);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(G + i), g);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(B + i), bl);
+        }
+
+        deinterleave_ssse3(src, R + i, G + i, B + i, count - i);
+    }
+
+    __attribute__((target("avx2"))) void interleave_avx2(unsigned char const* R, unsigned char const* G, unsigned char const* B, unsigned char* dst, size_t count)
+    {
+        auto const r0 { _mm256_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5) };
+        auto const g0 { _mm256_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1) };
+        auto const b0 { _mm256_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1) };
+        auto const r1 { _mm256_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1) };
+        auto const g1 { _mm256_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10) };
+        auto const b1 { _mm256_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1) };
+        auto const r2 { _mm256_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1) };
+        auto const g2 { _mm256_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1) };
+        auto const b2 { _mm256_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15) };
+
+        size_t i { 0 };
+
+        for (; i + 32 <= count; i += 32, dst += 96) {
+            auto r { _mm256_loadu_si256(reinterpret_cast<__m256i const*>(R + i)) };
+            auto g { _mm256_loadu_si256(reinterpret_cast<__m256i const*>(G + i)) };
+            auto b { _mm256_loadu_si256(reinterpret_cast<__m256i const*>(B + i)) };
+
+            auto a { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r0), _mm256_shuffle_epi8(g, g0)), _mm256_shuffle_epi8(b, b0)) };
+            auto m { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r1), _mm256_shuffle_epi8(g, g1)), _mm256_shuffle_epi8(b, b1)) };
+            auto c { _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, r2), _mm256_shuffle_epi8(g, g2)), _mm256_shuffle_epi8(b, b2)) };
+
+            store_lanes(dst, dst + 48, a);
+            store_lanes(dst + 16, dst + 64, m);
+            store_lanes(dst + 32, dst + 80, c);
+        }
+
+        interleave_ssse3(R + i, G + i, B + i, dst, count - i);
+    }
+
+}
+
+void deinterleave(unsigned char const* src, unsigned char* R, unsigned char* G, unsigned char* B, size_t count)
+{
+    static auto const kernel { __builtin_cpu_supports("avx2") ? deinterleave_avx2
+            : __builtin_cpu_supports("ssse3")                 ? deinterleave_ssse3
+                                                              : deinterleave_scalar };
+
+    kernel(src, R, G, B, count);
+}
+
+void interleave(unsigned char const* R, unsigned char const* G, unsigned char const* B, unsigned char* dst, size_t count)
+{
+    static auto const kernel { __builtin_cpu_supports("avx2") ? interleave_avx2
+            : __builtin_cpu_supports("ssse3")                 ? interleave_ssse3
+                                                              : interleave_scalar };
+
+    kernel(R, G, B, dst, count);
+}
+
+}
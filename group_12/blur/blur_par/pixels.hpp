@@ -0,0 +1,20 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include <cstddef>
+
+#if !defined(PIXELS_HPP)
+#define PIXELS_HPP
+
+namespace Pixels {
+
+// Splits count interleaved RGB pixels from src into the three planes R, G and B
+void deinterleave(unsigned char const* src, unsigned char* R, unsigned char* G, unsigned char* B, size_t count);
+
+// Merges count pixels from the planes R, G and B into interleaved RGB at dst
+void interleave(unsigned char const* R, unsigned char const* G, unsigned char const* B, unsigned char* dst, size_t count);
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include "pool.hpp"
+#include <algorithm>
+#include <chrono>
+
+Pool::Pool(unsigned count)
+    : threads(std::max(count, 1u))
+    , generation { 0 }
+    , remaining { 0 }
+    , stopping { false }
+    , phases { nullptr }
+    , phase_count { 0 }
+    , args { nullptr }
+    , arg_size { 0 }
+    , busy_seconds(threads.size())
+{
+    pthread_mutex_init(&mutex, nullptr);
+    pthread_cond_init(&start, nullptr);
+    pthread_cond_init(&done, nullptr);
+    pthread_barrier_init(&barrier, nullptr, threads.size());
+
+    for (auto t { 0u }; t < threads.size(); t++) {
+        starts.push_back({ this, t });
+    }
+    for (auto t { 0u }; t < threads.size(); t++) {
+        pthread_create(&threads[t], nullptr, thread_main, &starts[t]);
+    }
+}
+
+Pool::~Pool()
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&start);
+    pthread_mutex_unlock(&mutex);
+
+    for (auto& thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    pthread_barrier_destroy(&barrier);
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&start);
+    pthread_mutex_destroy(&mutex);
+}
+
+unsigned Pool::size() const
+{
+    return threads.size();
+}
+
+double Pool::busy(unsigned t) const
+{
+    return busy_seconds[t];
+}
+
+void Pool::reset_busy()
+{
+    std::fill(busy_seconds.begin(), busy_seconds.end(), 0);
+}
+
+void* Pool::thread_main(void* arg)
+{
+    auto start { static_cast<Start*>(arg) };
+    start->pool->work(start->index);
+    return nullptr;
+}
+
+void Pool::work(unsigned index)
+{
+    unsigned seen { 0 };
+
+    while (true) {
+        pthread_mutex_lock(&mutex);
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&start, &mutex);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        seen = generation;
+        auto job_phases { phases };
+        auto job_phase_count { phase_count };
+        auto arg { args + index * arg_size };
+        pthread_mutex_unlock(&mutex);
+
+        for (auto p { 0u }; p < job_phase_count; p++) {
+            if (p > 0) {
+                pthread_barrier_wait(&barrier);
+            }
+            auto begin { std::chrono::steady_clock::now() };
+            job_phases[p](arg);
+            busy_seconds[index] += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        }
+
+        pthread_mutex_lock(&mutex);
+        if (--remaining == 0) {
+            pthread_cond_signal(&done);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+void Pool::run(const Task* job_phases, unsigned job_phase_count, void* job_args, size_t job_arg_size)
+{
+    pthread_mutex_lock(&mutex);
+    phases = job_phases;
+    phase_count = job_phase_count;
+    args = static_cast<char*>(job_args);
+    arg_size = job_arg_size;
+    remaining = threads.size();
+    generation++;
+    pthread_cond_broadcast(&start);
+
+    while (remaining > 0) {
+        pthread_cond_wait(&done, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+Task_Queues::Task_Queues(unsigned threads)
+    : queues(std::max(threads, 1u))
+{
+    for (auto& queue : queues) {
+        pthread_mutex_init(&queue.mutex, nullptr);
+    }
+}
+
+Task_Queues::~Task_Queues()
+{
+    for (auto& queue : queues) {
+        pthread_mutex_destroy(&queue.mutex);
+    }
+}
+
+void Task_Queues::fill(unsigned count)
+{
+    auto run { count / queues.size() }, extra { count % queues.size() };
+    auto task { 0u };
+
+    for (auto t { 0u }; t < queues.size(); t++) {
+        auto& queue { queues[t] };
+        pthread_mutex_lock(&queue.mutex);
+        queue.tasks.clear();
+        // the first count % threads runs get one task more
+        for (auto end { task + run + (t < extra) }; task < end; task++) {
+            queue.tasks.push_back(task);
+        }
+        pthread_mutex_unlock(&queue.mutex);
+    }
+}
+
+bool Task_Queues::take(Queue& queue, unsigned& task, bool front)
+{
+    pthread_mutex_lock(&queue.mutex);
+    auto found { !queue.tasks.empty() };
+    if (found) {
+        if (front) {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+    }
+    pthread_mutex_unlock(&queue.mutex);
+    return found;
+}
+
+bool Task_Queues::next(unsigned thread, unsigned& task)
+{
+    if (take(queues[thread], task, true)) {
+        return true;
+    }
+
+    // steal from the back, away from where the owner is working, starting with the
+    // next thread so the thieves spread out over the victims
+    for (auto i { 1u }; i < queues.size(); i++) {
+        if (take(queues[(thread + i) % queues.size()], task, false)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,103 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include <cstddef>
+#include <deque>
+#include <initializer_list>
+#include <pthread.h>
+#include <vector>
+
+#if !defined(POOL_HPP)
+#define POOL_HPP
+
+// A fixed set of threads that stay parked between jobs, so callers that blur many
+// images pay for pthread_create once instead of twice per image
+class Pool {
+public:
+    // Worker function, called with the argument belonging to the thread
+    using Task = void* (*)(void*);
+
+private:
+    struct Start {
+        Pool* pool;
+        unsigned index;
+    };
+
+    std::vector<pthread_t> threads;
+    std::vector<Start> starts;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // separates the phases of a job, every thread finishes one before any starts the next
+    pthread_barrier_t barrier;
+
+    // current job, guarded by mutex, a new job bumps generation
+    unsigned generation;
+    unsigned remaining;
+    bool stopping;
+    const Task* phases;
+    unsigned phase_count;
+    char* args;
+    size_t arg_size;
+
+    // seconds each thread has spent running phases, written only by that thread
+    std::vector<double> busy_seconds;
+
+    static void* thread_main(void* arg);
+    void work(unsigned index);
+    void run(const Task* phases, unsigned phase_count, void* args, size_t arg_size);
+
+public:
+    // Starts count threads, at least one
+    explicit Pool(unsigned count);
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+    ~Pool();
+
+    unsigned size() const;
+
+    // Seconds thread t has spent inside phases since the pool started or the last
+    // reset_busy, not counting waits at the barrier or for the next job
+    double busy(unsigned t) const;
+    void reset_busy();
+
+    // Thread t runs every phase in order on args[t], waiting at a barrier between
+    // phases. Returns when all threads are done. args must have size() elements.
+    template <typename T>
+    void run(std::initializer_list<Task> phases, T* args)
+    {
+        run(phases.begin(), phases.size(), args, sizeof(T));
+    }
+};
+
+// Per-thread deques of task numbers for load balancing on a Pool. Each thread takes
+// tasks from the front of its own deque and, once that is empty, steals from the back
+// of the others, so threads that fall behind get relieved by the ones that are ahead.
+class Task_Queues {
+private:
+    struct Queue {
+        pthread_mutex_t mutex;
+        std::deque<unsigned> tasks;
+    };
+
+    std::vector<Queue> queues;
+
+    bool take(Queue& queue, unsigned& task, bool front);
+
+public:
+    explicit Task_Queues(unsigned threads);
+    Task_Queues(const Task_Queues&) = delete;
+    Task_Queues& operator=(const Task_Queues&) = delete;
+    ~Task_Queues();
+
+    // Deals the tasks 0 .. count - 1 out in contiguous runs, one run per thread, so
+    // neighbouring tasks start out on the same thread
+    void fill(unsigned count);
+
+    // Next task for thread, its own first and then stolen, false once all are taken
+    bool next(unsigned thread, unsigned& task);
+};
+
+#endif
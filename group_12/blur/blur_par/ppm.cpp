@@ -3,146 +3,279 @@ Author: David Holmqvist <daae19@student.bth.se>
 */
 
 #include "ppm.hpp"
+#include "pixels.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <regex>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
 
 namespace PPM {
 
-void Reader::fill(std::string filename)
-{
-    std::ifstream f {};
+namespace {
+
+    // Read-only mapping of a whole file, unmapped again when it goes out of scope
+    class Mapping {
+    private:
+        int fd;
+        void* data;
+        size_t size;
+
+    public:
+        Mapping(std::string const& filename)
+            : fd { open(filename.c_str(), O_RDONLY) }
+            , data { MAP_FAILED }
+            , size { 0 }
+        {
+            if (fd < 0) {
+                throw std::runtime_error { "couldn't open file " + filename };
+            }
+
+            struct stat st { };
+
+            if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                close(fd);
+                throw std::runtime_error { "couldn't stat file " + filename };
+            }
+
+            size = st.st_size;
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error { "couldn't map file " + filename };
+            }
+
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
 
-    f.open(filename);
+        Mapping(Mapping const&) = delete;
+        Mapping& operator=(Mapping const&) = delete;
 
-    if (!f) {
-        stream.setstate(std::ios::failbit);
-        return;
+        ~Mapping()
+        {
+            munmap(data, size);
+            close(fd);
+        }
+
+        char const* begin() const
+        {
+            return static_cast<char const*>(data);
+        }
+
+        char const* end() const
+        {
+            return begin() + size;
+        }
+    };
+
+    // Writes all of parts to fd, resuming after short writes, false on error
+    bool write_all(int fd, iovec* parts, int count)
+    {
+        while (count > 0) {
+            auto written { writev(fd, parts, count) };
+
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+
+            auto done { static_cast<size_t>(written) };
+
+            while (count > 0 && done >= parts->iov_len) {
+                done -= parts->iov_len;
+                parts++;
+                count--;
+            }
+
+            if (count > 0) {
+                parts->iov_base = static_cast<char*>(parts->iov_base) + done;
+                parts->iov_len -= done;
+            }
+        }
+
+        return true;
     }
 
-    std::copy(
-        std::istreambuf_iterator<char> { f.rdbuf() },
-        std::istreambuf_iterator<char> {},
-        std::ostreambuf_iterator<char> { stream });
+    // Reads up to size bytes, fewer only at the end of the file, -1 on error
+    ssize_t read_all(int fd, char* data, size_t size)
+    {
+        size_t done { 0 };
+
+        while (done < size) {
+            auto got { read(fd, data + done, size - done) };
+
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (got == 0) {
+                break;
+            }
+            done += got;
+        }
 
-    f.close();
-}
+        return done;
+    }
 
-std::string Reader::get_magic_number()
-{
-    std::string magic {};
+    std::string header_string(unsigned x_size, unsigned y_size, unsigned color_max)
+    {
+        return std::string { magic_number } + "\n"
+            + std::to_string(x_size) + " " + std::to_string(y_size) + "\n"
+            + std::to_string(color_max) + "\n";
+    }
 
-    std::getline(stream, magic);
+    // Longest header Row_Reader accepts, comments included
+    constexpr size_t max_header_size { 64 * 1024 };
 
-    return magic;
-}
+    bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
 
-std::pair<unsigned, unsigned> Reader::get_dimensions()
-{
-    std::string line {};
+    // Skips whitespace and comments, which run from '#' to the end of the line
+    void skip_separators(char const*& it, char const* end)
+    {
+        while (it < end) {
+            if (is_space(*it)) {
+                it++;
+            } else if (*it == '#') {
+                while (it < end && *it != '\n' && *it != '\r') {
+                    it++;
+                }
+            } else {
+                break;
+            }
+        }
+    }
 
-    while (std::getline(stream, line) && line[0] == '#')
-        ;
+    // Reads one header field, which must be followed by whitespace or a comment, 0 on failure
+    unsigned read_field(char const*& it, char const* end)
+    {
+        skip_separators(it, end);
 
-    std::regex regex { "^(\\d+) (\\d+)$" };
-    std::smatch matches {};
+        unsigned value { 0 };
+        auto [ptr, ec] { std::from_chars(it, end, value) };
 
-    std::regex_match(line, matches, regex);
+        if (ec != std::errc {} || ptr == end || (!is_space(*ptr) && *ptr != '#')) {
+            return 0;
+        }
 
-    if (matches.ready()) {
-        return { std::stoul(matches[1]), std::stoul(matches[2]) };
-    } else {
-        return { 0, 0 };
+        it = ptr;
+        return value;
     }
+
 }
 
-unsigned Reader::get_color_max()
+char const* parse_header(char const* begin, char const* end, Header& header)
 {
-    std::string line {};
+    auto it { begin };
 
-    std::getline(stream, line);
+    if (end - it < 2 || it[0] != magic_number[0] || it[1] != magic_number[1]
+        || (end - it > 2 && !is_space(it[2]) && it[2] != '#')) {
+        auto length { std::min<size_t>(end - it, 2) };
+        throw std::runtime_error { "incorrect magic number: " + std::string { it, length } };
+    }
 
-    std::regex regex { "^(\\d+)$" };
-    std::smatch matches {};
+    it += 2;
 
-    std::regex_match(line, matches, regex);
+    header.x_size = read_field(it, end);
+    header.y_size = read_field(it, end);
 
-    if (matches.ready()) {
-        return std::stoul(matches[1]);
-    } else {
-        return 0;
+    if (header.x_size == 0 || header.y_size == 0) {
+        throw std::runtime_error { "couldn't read dimensions" };
     }
-}
 
-std::tuple<unsigned char*, unsigned char*, unsigned char*> Reader::get_data(unsigned x_size, unsigned y_size)
-{
-    auto size { x_size * y_size };
-    auto R { new char[size] }, G { new char[size] }, B { new char[size] };
-
-    for (auto i { 0 }, read { 0 }; i < size; i++, read = 0) {
-        stream.read(R + i, 1);
-        read += stream.gcount();
-        stream.read(G + i, 1);
-        read += stream.gcount();
-        stream.read(B + i, 1);
-        read += stream.gcount();
-
-        if (read != 3) {
-            delete[] R;
-            delete[] G;
-            delete[] B;
-            return { nullptr, nullptr, nullptr };
-        }
+    header.color_max = read_field(it, end);
+
+    if (header.color_max == 0) {
+        throw std::runtime_error { "couldn't read color max" };
+    }
+
+    if (header.color_max > 255) {
+        throw std::runtime_error { "unsupported color max: " + std::to_string(header.color_max) };
     }
 
-    return { reinterpret_cast<unsigned char*>(R), reinterpret_cast<unsigned char*>(G), reinterpret_cast<unsigned char*>(B) };
+    // Exactly one whitespace character separates the color max from the raster
+    if (it == end || !is_space(*it)) {
+        throw std::runtime_error { "couldn't read color max" };
+    }
+
+    return it + 1;
 }
 
-Matrix Reader::operator()(std::string filename)
+void Reader::fill(std::string filename)
 {
-    try {
-        fill(filename);
+    std::ifstream f { filename, std::ios::binary | std::ios::ate };
 
-        if (stream.fail()) {
-            throw std::runtime_error { "couldn't open file " + filename };
-        }
+    if (!f) {
+        throw std::runtime_error { "couldn't open file " + filename };
+    }
 
-        auto magic { get_magic_number() };
+    buffer.resize(f.tellg());
+    f.seekg(0);
 
-        if (magic != magic_number) {
-            throw std::runtime_error { "incorrect magic number: " + magic };
-        }
+    if (!f.read(buffer.data(), buffer.size())) {
+        throw std::runtime_error { "couldn't read file " + filename };
+    }
+}
 
-        auto [x_size, y_size] { get_dimensions() };
+Matrix Reader::parse(char const* begin, char const* end)
+{
+    Header header {};
+    auto data { parse_header(begin, end, header) };
+    auto total_size { header.x_size * header.y_size };
 
-        if (x_size == 0 || y_size == 0) {
-            throw std::runtime_error { "couldn't read dimensions" };
-        }
+    if (header.x_size > max_dimension || header.y_size > max_dimension || total_size > max_pixels) {
+        throw std::runtime_error { "image size is too big: " + std::to_string(total_size) };
+    }
 
-        auto total_size { x_size * y_size };
+    if (static_cast<size_t>(end - data) < 3ul * total_size) {
+        throw std::runtime_error { "couldn't read image data" };
+    }
 
-        if (total_size > max_pixels) {
-            throw std::runtime_error { "image size is too big: " + std::to_string(total_size) };
-        }
+    Matrix m { header.x_size, header.y_size, header.color_max };
+    auto src { reinterpret_cast<unsigned char const*>(data) };
 
-        auto color_max { get_color_max() };
+    // row by row, the planes have padded rows
+    for (auto y { 0u }; y < header.y_size; y++) {
+        size_t offset { y * m.get_stride() };
+        Pixels::deinterleave(src + 3ul * y * header.x_size, const_cast<unsigned char*>(m.get_R()) + offset,
+            const_cast<unsigned char*>(m.get_G()) + offset, const_cast<unsigned char*>(m.get_B()) + offset, header.x_size);
+    }
 
-        if (color_max == 0) {
-            throw std::runtime_error { "couldn't read color max" };
-        }
+    return m;
+}
 
-        auto [R, G, B] { get_data(x_size, y_size) };
+Reader::Reader(Mode mode)
+    : mode { mode }
+{
+}
 
-        if (!R || !G || !B) {
-            throw std::runtime_error { "couldn't read image data" };
+Matrix Reader::operator()(std::string filename)
+{
+    try {
+        if (mode == Mode::mmap) {
+            // Deinterleaves straight from the mapping into the planes, no intermediate copy
+            Mapping file { filename };
+            return parse(file.begin(), file.end());
         }
 
-        stream.clear();
-        return Matrix { R, G, B, x_size, y_size, color_max };
-    } catch (std::runtime_error e) {
+        fill(filename);
+        return parse(buffer.data(), buffer.data() + buffer.size());
+    } catch (std::runtime_error const& e) {
         error("reading", e.what());
-        stream.clear();
         return Matrix {};
     }
 }
@@ -152,35 +285,140 @@ void error(std::string op, std::string what)
     std::cerr << "Encountered PPM error during " << op << ": " << what << std::endl;
 }
 
-void Writer::operator()(Matrix m, std::string filename)
+bool Writer::operator()(Matrix const& m, std::string filename)
 {
+    if (m.get_layout() == Matrix::Layout::packed) {
+        return (*this)(Matrix { m, Matrix::Layout::planar }, filename);
+    }
+
     try {
-        std::ofstream f {};
+        auto header { header_string(m.get_x_size(), m.get_y_size(), m.get_color_max()) };
 
-        f.open(filename);
+        // Interleave the whole image up front so header and payload go out in one writev
+        size_t size { m.get_x_size() * m.get_y_size() };
+        std::vector<unsigned char> payload(3 * size);
 
-        if (!f) {
+        for (auto y { 0u }; y < m.get_y_size(); y++) {
+            size_t offset { y * m.get_stride() };
+            Pixels::interleave(m.get_R() + offset, m.get_G() + offset, m.get_B() + offset, payload.data() + 3ul * y * m.get_x_size(), m.get_x_size());
+        }
+
+        auto fd { open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+
+        if (fd < 0) {
             throw std::runtime_error { "failed to open " + filename };
         }
 
-        f << magic_number << std::endl;
+        iovec parts[] {
+            { header.data(), header.size() },
+            { payload.data(), payload.size() },
+        };
 
-        f << m.get_x_size() << " " << m.get_y_size() << std::endl;
-        f << m.get_color_max() << std::endl;
+        auto written { write_all(fd, parts, 2) };
 
-        auto size { m.get_x_size() * m.get_y_size() };
-        auto R { m.get_R() }, G { m.get_G() }, B { m.get_B() };
-        auto it_R { R }, it_G { G }, it_B { B };
+        close(fd);
 
-        while (it_R < R + size && it_G < G + size && it_B < B + size) {
-            f << *it_R++
-              << *it_G++
-              << *it_B++;
+        if (!written) {
+            throw std::runtime_error { "failed to write " + filename };
         }
-
-        f.close();
-    } catch (std::runtime_error e) {
+    } catch (std::runtime_error const& e) {
         error("writing", e.what());
+        return false;
+    }
+    return true;
+}
+
+Row_Reader::Row_Reader(std::string filename)
+    : fd { open(filename.c_str(), O_RDONLY) }
+    , header {}
+    , pending(max_header_size)
+    , pending_used { 0 }
+{
+    if (fd < 0) {
+        throw std::runtime_error { "couldn't open file " + filename };
+    }
+
+    // the header is parsed from the first block, whatever raster follows it is kept
+    auto got { read_all(fd, pending.data(), pending.size()) };
+
+    if (got < 0) {
+        close(fd);
+        throw std::runtime_error { "couldn't read file " + filename };
+    }
+
+    try {
+        auto data { parse_header(pending.data(), pending.data() + got, header) };
+        pending_used = data - pending.data();
+        pending.resize(got);
+    } catch (std::runtime_error const&) {
+        close(fd);
+        throw;
+    }
+
+    row.resize(3ul * header.x_size);
+}
+
+Row_Reader::~Row_Reader()
+{
+    close(fd);
+}
+
+Header const& Row_Reader::get_header() const
+{
+    return header;
+}
+
+void Row_Reader::operator()(unsigned char* R, unsigned char* G, unsigned char* B)
+{
+    auto from_pending { std::min(row.size(), pending.size() - pending_used) };
+
+    std::copy(pending.data() + pending_used, pending.data() + pending_used + from_pending, row.data());
+    pending_used += from_pending;
+
+    auto rest { row.size() - from_pending };
+
+    if (rest > 0 && read_all(fd, row.data() + from_pending, rest) != static_cast<ssize_t>(rest)) {
+        throw std::runtime_error { "couldn't read image data" };
+    }
+
+    Pixels::deinterleave(reinterpret_cast<unsigned char const*>(row.data()), R, G, B, header.x_size);
+}
+
+Row_Writer::Row_Writer(std::string filename, Header const& header)
+    : fd { open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) }
+    , x_size { header.x_size }
+    , row(3ul * header.x_size)
+{
+    if (fd < 0) {
+        throw std::runtime_error { "failed to open " + filename };
+    }
+
+    auto text { header_string(header.x_size, header.y_size, header.color_max) };
+    iovec parts[] {
+        { text.data(), text.size() },
+    };
+
+    if (!write_all(fd, parts, 1)) {
+        close(fd);
+        throw std::runtime_error { "failed to write " + filename };
+    }
+}
+
+Row_Writer::~Row_Writer()
+{
+    close(fd);
+}
+
+void Row_Writer::operator()(unsigned char const* R, unsigned char const* G, unsigned char const* B)
+{
+    Pixels::interleave(R, G, B, row.data(), x_size);
+
+    iovec parts[] {
+        { row.data(), row.size() },
+    };
+
+    if (!write_all(fd, parts, 1)) {
+        throw std::runtime_error { "failed to write image data" };
     }
 }
 
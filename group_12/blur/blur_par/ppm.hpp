@@ -5,7 +5,8 @@ Author: David Holmqvist <daae19@student.bth.se>
 #include "matrix.hpp"
 #include <exception>
 #include <iostream>
-#include <sstream>
+#include <string>
+#include <vector>
 
 #if !defined(PPM_READER_HPP)
 #define PPM_READER_HPP
@@ -18,15 +19,34 @@ constexpr unsigned max_dimension { 3000 };
 constexpr unsigned max_pixels { max_dimension * max_dimension };
 constexpr char const* magic_number { "P6" };
 
+struct Header {
+    unsigned x_size;
+    unsigned y_size;
+    unsigned color_max;
+};
+
+// Parses a P6 header from [begin, end) following the netpbm rules (fields separated by
+// any whitespace, comments anywhere before the color max) without allocating. Returns
+// a pointer to the first byte of the raster, throws std::runtime_error on bad input.
+char const* parse_header(char const* begin, char const* end, Header& header);
+
 class Reader {
+public:
+    // stream reads the file into a buffer before parsing it, mmap maps the
+    // file and deinterleaves the pixel data straight into the Matrix planes
+    enum class Mode {
+        stream,
+        mmap,
+    };
+
+    Reader(Mode mode = Mode::stream);
+
 private:
-    std::stringstream stream;
+    Mode mode;
+    std::vector<char> buffer;
 
-    std::string get_magic_number();
-    std::pair<unsigned, unsigned> get_dimensions();
-    std::tuple<unsigned char*, unsigned char*, unsigned char*> get_data(unsigned x_size, unsigned y_size);
-    unsigned get_color_max();
     void fill(std::string filename);
+    Matrix parse(char const* begin, char const* end);
 
 public:
     Matrix operator()(std::string filename);
@@ -34,7 +54,51 @@ public:
 
 class Writer {
 public:
-    void operator()(Matrix m, std::string filename);
+    // Reports failures like Reader does, returns whether the image was written
+    bool operator()(Matrix const& m, std::string filename);
+};
+
+// Reads a P6 image one row at a time for images too big to load whole, so it is not
+// bound by max_dimension. Only the header and one row are held in memory.
+class Row_Reader {
+private:
+    int fd;
+    Header header;
+    // raster bytes that came in with the header
+    std::vector<char> pending;
+    size_t pending_used;
+    std::vector<char> row;
+
+public:
+    // Opens filename and parses its header, throws std::runtime_error on failure
+    Row_Reader(std::string filename);
+    Row_Reader(Row_Reader const&) = delete;
+    Row_Reader& operator=(Row_Reader const&) = delete;
+    ~Row_Reader();
+
+    Header const& get_header() const;
+
+    // Reads the next row into R, G and B, x_size pixels each. Throws
+    // std::runtime_error when the file ends early.
+    void operator()(unsigned char* R, unsigned char* G, unsigned char* B);
+};
+
+// Writes a P6 image one row at a time, the counterpart of Row_Reader
+class Row_Writer {
+private:
+    int fd;
+    unsigned x_size;
+    std::vector<unsigned char> row;
+
+public:
+    // Creates filename and writes the header, throws std::runtime_error on failure
+    Row_Writer(std::string filename, Header const& header);
+    Row_Writer(Row_Writer const&) = delete;
+    Row_Writer& operator=(Row_Writer const&) = delete;
+    ~Row_Writer();
+
+    // Appends a row of x_size pixels from R, G and B, throws std::runtime_error on failure
+    void operator()(unsigned char const* R, unsigned char const* G, unsigned char const* B);
 };
 
 }
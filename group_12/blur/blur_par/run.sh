@@ -20,6 +20,28 @@ for img in "${images[@]}"; do
     done
 done
 
+# Blur all images in one process, overlapping reads and writes with the blur
+for thread in "${threads[@]}"; do
+    echo "Running batch blur on data with $thread thread(s)..."
+    ./blur_par 15 data data_o/batch $thread batch
+    echo "-----------------------------------------"
+done
+
+# Compare the planar and the packed RGBX layout, stats prints the time spent blurring
+for img in "${images[@]}"; do
+    for radius in 1 3 15 16 31; do
+        for layout in planar packed; do
+            echo "Blurring $img with radius $radius in the $layout layout..."
+            if [ $layout = packed ]; then
+                ./blur_par $radius "data/$img" "data_o/blur_${img%.*}_$layout.ppm" 1 packed stats
+            else
+                ./blur_par $radius "data/$img" "data_o/blur_${img%.*}_$layout.ppm" 1 stats
+            fi
+        done
+        echo "-----------------------------------------"
+    done
+done
+
 # Run valgrind tests
 echo "Running valgrind (callgrind) on im1.ppm with different thread counts..."
 for thread in "${threads[@]}"; do
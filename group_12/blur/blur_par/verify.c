@@ -0,0 +1,188 @@
+/*
+Author: David Holmqvist <daae19@student.bth.se>
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Reads a P6 header and returns the number of raster bytes, 0 on error */
+static unsigned long read_header(FILE *f)
+{
+	unsigned x_size, y_size, color_max;
+	int c;
+
+	if (fgetc(f) != 'P' || fgetc(f) != '6')
+	{
+		return 0;
+	}
+
+	/* skip comments between the fields */
+	for (int field = 0; field < 3; field++)
+	{
+		while ((c = fgetc(f)) != EOF && (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '#'))
+		{
+			if (c == '#')
+			{
+				while ((c = fgetc(f)) != EOF && c != '\n')
+					;
+			}
+		}
+		if (c == EOF)
+		{
+			return 0;
+		}
+		ungetc(c, f);
+
+		unsigned *value = field == 0 ? &x_size : field == 1 ? &y_size : &color_max;
+		if (fscanf(f, "%u", value) != 1)
+		{
+			return 0;
+		}
+	}
+
+	if (fgetc(f) == EOF || color_max > 255)
+	{
+		return 0;
+	}
+
+	return 3ul * x_size * y_size;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+	int tolerance = 0;
+	FILE *f1 = NULL;
+	FILE *f2 = NULL;
+
+	if (argc < 3)
+	{
+#ifndef QUIET
+		fprintf(stderr, "ERROR:\tWrong usage.\n");
+		fprintf(stderr, "Usage:\t%s <file1> <file2> [tolerance]\n", argv[0]);
+		fprintf(stderr,
+				"\tThis program compares the pixel data of the PPM images <file1> and\n"
+				"\t<file2> and prints the largest and mean absolute channel difference\n"
+				"\tand the PSNR. If the images are identical, 0 will be returned. If no\n"
+				"\tchannel differs by more than [tolerance] (default 0), 1 will be\n"
+				"\treturned, otherwise 2. If there is an error while executing this\n"
+				"\tprogram, -1 will be returned, unless the images have different\n"
+				"\tdimensions, in which case 2 will be returned. Define QUIET in the\n"
+				"\tsource code or compile with -DQUIET to prevent the program from\n"
+				"\tprinting anything.\n");
+#endif
+		ret = -1;
+		goto end;
+	}
+
+	if (argc > 3)
+	{
+		tolerance = atoi(argv[3]);
+	}
+
+	f1 = fopen(argv[1], "rb");
+	if (!f1)
+	{
+#ifndef QUIET
+		fprintf(stderr, "ERROR:\tCannot open file '%s'.\n", argv[1]);
+#endif
+		ret = -1;
+		goto end;
+	}
+	f2 = fopen(argv[2], "rb");
+	if (!f2)
+	{
+#ifndef QUIET
+		fprintf(stderr, "ERROR:\tCannot open file '%s'.\n", argv[2]);
+#endif
+		ret = -1;
+		goto close_end;
+	}
+
+	unsigned long size1 = read_header(f1);
+	unsigned long size2 = read_header(f2);
+
+	if (size1 == 0 || size2 == 0)
+	{
+#ifndef QUIET
+		fprintf(stderr, "ERROR:\tCannot read the PPM header of '%s'.\n", size1 == 0 ? argv[1] : argv[2]);
+#endif
+		ret = -1;
+		goto close_end;
+	}
+	if (size1 != size2)
+	{
+#ifndef QUIET
+		fprintf(stderr, "ERROR:\tImages '%s' and '%s' have different dimensions.\n", argv[1], argv[2]);
+#endif
+		ret = 2;
+		goto close_end;
+	}
+
+	int max_error = 0;
+	unsigned long differing = 0;
+	double sum_error = 0, sum_squared = 0;
+
+	for (unsigned long i = 0; i < size1; i++)
+	{
+		int c1 = fgetc(f1);
+		int c2 = fgetc(f2);
+
+		if (c1 == EOF || c2 == EOF)
+		{
+#ifndef QUIET
+			fprintf(stderr, "ERROR:\tUnexpected end of pixel data in '%s'.\n", c1 == EOF ? argv[1] : argv[2]);
+#endif
+			ret = 2;
+			goto close_end;
+		}
+
+		int error = abs(c1 - c2);
+		if (error > max_error)
+		{
+			max_error = error;
+		}
+		if (error > 0)
+		{
+			differing++;
+		}
+		sum_error += error;
+		sum_squared += (double)error * error;
+	}
+
+	if (max_error > tolerance)
+	{
+		ret = 2;
+	}
+	else if (max_error > 0)
+	{
+		ret = 1;
+	}
+
+#ifndef QUIET
+	printf("max error: %d, mean error: %.4f, differing channels: %lu of %lu, PSNR: ",
+		   max_error, sum_error / size1, differing, size1);
+	if (sum_squared > 0)
+	{
+		printf("%.2f dB\n", 10 * log10(255.0 * 255.0 * size1 / sum_squared));
+	}
+	else
+	{
+		printf("inf\n");
+	}
+#endif
+
+close_end:
+	if (f1)
+	{
+		fclose(f1);
+	}
+	if (f2)
+	{
+		fclose(f2);
+	}
+
+end:
+	return ret;
+}
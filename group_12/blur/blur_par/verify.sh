@@ -1,24 +1,143 @@
 #!/bin/bash
 
-echo "NOTE: this script relies on the binaries blur and blur_par to exist"
+echo "NOTE: this script relies on the binaries blur, blur_par and verify to exist"
 
 status=0
 red=$(tput setaf 1)
 reset=$(tput sgr0)
 
-for thread in 1 2 4 8 16 32
+for schedule in passes pipelined
+do
+    for thread in 1 2 4 8 16 32
+    do
+        for image in im1 im2 im3 im4
+        do
+            ./blur_par 15 "data/$image.ppm" "./data_o/blur_${image}_par.ppm" $thread $schedule
+
+            if ! cmp -s "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_par.ppm"
+            then
+                echo "${red}Error: Incongruent output data detected when blurring image $image.ppm with $thread thread(s) in $schedule${reset}"
+                status=1
+            fi
+
+            rm "./data_o/blur_${image}_par.ppm"
+        done
+    done
+done
+
+# A chain of one blur goes through the fused chain engine and has to match as well
+for thread in 1 2 4
+do
+    for image in im1 im2 im3 im4
+    do
+        ./blur_par blur:15 "data/$image.ppm" "./data_o/blur_${image}_chain.ppm" $thread
+
+        if ! cmp -s "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_chain.ppm"
+        then
+            echo "${red}Error: Incongruent output data detected when blurring image $image.ppm with $thread thread(s) as a chain${reset}"
+            status=1
+        fi
+
+        rm "./data_o/blur_${image}_chain.ppm"
+    done
+done
+
+# A region covering the whole image goes through the view engine and has to match too
+for thread in 1 2 4
+do
+    for image in im1 im2 im3 im4
+    do
+        size=$(head -c 200 "data/$image.ppm" | grep -av '^#' | sed -n 2p)
+        ./blur_par 15 "data/$image.ppm" "./data_o/blur_${image}_roi.ppm" $thread "roi:0,0,${size/ /,}"
+
+        if ! cmp -s "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_roi.ppm"
+        then
+            echo "${red}Error: Incongruent output data detected when blurring image $image.ppm with $thread thread(s) as a region${reset}"
+            status=1
+        fi
+
+        rm "./data_o/blur_${image}_roi.ppm"
+    done
+done
+
+# Edit overlapping rectangles and one at the corner of each image, and bring its
+# reference up to date with them, which has to match blurring the edited image whole
+for thread in 1 2 4
+do
+    for image in im1 im2 im3 im4
+    do
+        read width height <<< "$(head -c 200 "data/$image.ppm" | grep -av '^#' | sed -n 2p)"
+        edited="./data_o/${image}_edited.ppm"
+        ./blur_par 5 "data/$image.ppm" "$edited" 1 roi:100,100,60,40
+        ./blur_par 7 "$edited" "$edited" 1 roi:130,120,50,50
+        ./blur_par 3 "$edited" "$edited" 1 "roi:$((width - 20)),$((height - 20)),20,20"
+
+        ./blur_par 15 "$edited" "./data_o/blur_${image}_full.ppm" $thread
+        ./blur_par 15 "$edited" "./data_o/blur_${image}_update.ppm" $thread "from:./data_o/${image}_seq.ppm" \
+            changed:100,100,60,40 changed:130,120,50,50 "changed:$((width - 20)),$((height - 20)),50,50"
+
+        if ! cmp -s "./data_o/blur_${image}_full.ppm" "./data_o/blur_${image}_update.ppm"
+        then
+            echo "${red}Error: Incongruent output data detected when updating the blur of image $image.ppm with $thread thread(s)${reset}"
+            status=1
+        fi
+
+        rm "$edited" "./data_o/blur_${image}_full.ppm" "./data_o/blur_${image}_update.ppm"
+    done
+done
+
+# The radius 15 output of a stack has to match as well
+for thread in 1 2 4
 do
     for image in im1 im2 im3 im4
     do
-        ./blur_par 15 "data/$image.ppm" "./data_o/blur_${image}_par.ppm" $thread
+        ./blur_par 3,15 "data/$image.ppm" "./data_o/blur_${image}_stack.ppm" $thread
 
-        if ! cmp -s "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_par.ppm"
+        if ! cmp -s "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_stack_1.ppm"
         then
-            echo "${red}Error: Incongruent output data detected when blurring image $image.ppm with $thread thread(s)${reset}"
+            echo "${red}Error: Incongruent output data detected when blurring image $image.ppm with $thread thread(s) in a stack${reset}"
             status=1
         fi
 
-        rm "./data_o/blur_${image}_par.ppm"
+        rm "./data_o/blur_${image}_stack_0.ppm" "./data_o/blur_${image}_stack_1.ppm"
+    done
+done
+
+# float32 rounds differently from the double reference and truncates after each pass
+# like it, sums a hair away from an integer can come out 1 apart in either pass. It is
+# compared with a tolerance of 2 instead of cmp.
+tolerance=2
+
+for thread in 1 2 4
+do
+    for image in im1 im2 im3 im4
+    do
+        ./blur_par 15 "data/$image.ppm" "./data_o/blur_${image}_float32.ppm" $thread float32
+
+        ./verify "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_float32.ppm" $tolerance > /dev/null
+
+        # verify returns 0 for identical images and 1 for images within the tolerance
+        if [ $? -gt 1 ]
+        then
+            echo "${red}Error: float32 output off by more than $tolerance when blurring image $image.ppm with $thread thread(s)${reset}"
+            status=1
+        fi
+
+        rm "./data_o/blur_${image}_float32.ppm"
+    done
+done
+
+# The approximate modes are not bit exact, report how far they are from the reference
+for mode in iir box
+do
+    for image in im1 im2 im3 im4
+    do
+        ./blur_par 15 "data/$image.ppm" "./data_o/blur_${image}_${mode}.ppm" 1 $mode
+
+        echo -n "Accuracy of $mode on $image.ppm: "
+        ./verify "./data_o/${image}_seq.ppm" "./data_o/blur_${image}_${mode}.ppm"
+
+        rm "./data_o/blur_${image}_${mode}.ppm"
     done
 done
 
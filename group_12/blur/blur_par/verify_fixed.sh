@@ -0,0 +1,67 @@
+#!/bin/bash
+
+echo "NOTE: this script relies on the binaries blur_par and verify to exist"
+
+# The fixed point mode is compared with the double mode at the same radius. Both
+# truncate after each pass, and sums that are a hair away from an integer can come
+# out 1 apart in either pass. Even exact arithmetic differs from the double mode by
+# up to 2 for that reason, so that is the tolerance.
+tolerance=2
+
+status=0
+red=$(tput setaf 1)
+reset=$(tput sgr0)
+
+for radius in 1 2 3 5 15 31
+do
+    for image in im1 im2 im3 im4
+    do
+        ./blur_par $radius "data/$image.ppm" "./data_o/blur_${image}_gauss.ppm" 1
+
+        for thread in 1 2 4
+        do
+            ./blur_par $radius "data/$image.ppm" "./data_o/blur_${image}_fixed.ppm" $thread fixed
+
+            ./verify "./data_o/blur_${image}_gauss.ppm" "./data_o/blur_${image}_fixed.ppm" $tolerance > /dev/null
+
+            # verify returns 0 for identical images and 1 for images within the tolerance
+            if [ $? -gt 1 ]
+            then
+                echo "${red}Error: fixed point output off by more than $tolerance when blurring image $image.ppm with radius $radius and $thread thread(s)${reset}"
+                status=1
+            fi
+
+            rm "./data_o/blur_${image}_fixed.ppm"
+        done
+
+        rm "./data_o/blur_${image}_gauss.ppm"
+    done
+done
+
+# Images one pixel wide or tall leave a single tap in the other direction, made from
+# the last pixels of im1
+for size in "1 64" "64 1"
+do
+    line="./data_o/line_${size/ /x}.ppm"
+    { printf 'P6\n%s\n255\n' "$size"; tail -c 192 data/im1.ppm; } > "$line"
+
+    for radius in 1 3 15
+    do
+        ./blur_par $radius "$line" "./data_o/blur_line_gauss.ppm" 1
+        ./blur_par $radius "$line" "./data_o/blur_line_fixed.ppm" 2 fixed
+
+        ./verify "./data_o/blur_line_gauss.ppm" "./data_o/blur_line_fixed.ppm" $tolerance > /dev/null
+
+        if [ $? -gt 1 ]
+        then
+            echo "${red}Error: fixed point output off by more than $tolerance when blurring a ${size/ /x} image with radius $radius${reset}"
+            status=1
+        fi
+
+        rm "./data_o/blur_line_gauss.ppm" "./data_o/blur_line_fixed.ppm"
+    done
+
+    rm "$line"
+done
+
+exit $status